@@ -0,0 +1,594 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+//
+// Load generator speaking the sqlizator protocol over TCP or a unix domain
+// socket. Every connection runs on its own thread, either in a closed loop,
+// sending the next request as soon as the previous reply arrived, or in an
+// open loop at a fixed rate, where latency is measured from the time a
+// request was due to be sent so that a stalled server cannot hide its
+// queueing delay.
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <msgpack.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sqlizator/histogram.h"
+#include "sqlizator/protocol.h"
+
+typedef std::map<std::string, std::string> ConfMap;
+typedef msgpack::packer<msgpack::sbuffer> Packer;
+typedef std::chrono::steady_clock Clock;
+
+enum RequestType {
+    CONNECT = 0,
+    QUERY = 1,
+    EXECUTEMANY = 2,
+    INSERT = 3,
+    REQUEST_TYPES = 4
+};
+
+static const char* REQUEST_NAMES[REQUEST_TYPES] = {
+    "connect",
+    "query",
+    "executemany",
+    "insert"
+};
+
+static const std::vector<std::string> OPTIONS{
+    "host",
+    "port",
+    "unix",
+    "connections",
+    "duration",
+    "warmup",
+    "rate",
+    "mix",
+    "rows",
+    "batch",
+    "table-rows",
+    "path",
+    "seed",
+    "group-commit",
+    "opcodes"
+};
+
+static const char* DATABASE = "bench";
+static const size_t RECV_SIZE = 65536;
+static const size_t SETUP_CHUNK = 1000;
+
+struct Config {
+    std::string host;
+    std::string port;
+    // connect to this unix domain socket instead of host and port
+    std::string unix_path;
+    int connections;
+    int duration;
+    int warmup;
+    // requests per second over all connections, zero runs a closed loop
+    double rate;
+    int weights[REQUEST_TYPES];
+    int rows;
+    int batch;
+    int table_rows;
+    std::string path;
+    unsigned seed;
+    // statements per group commit of the benchmark database, if it gets
+    // opened by this run
+    int group_commit;
+    // send endpoints and request keys as numbers instead of names
+    bool opcodes;
+};
+
+struct Results {
+    sqlizator::Histogram latency[REQUEST_TYPES];
+    std::atomic<uint64_t> errors[REQUEST_TYPES];
+
+    Results() {
+        for (int i = 0; i < REQUEST_TYPES; ++i)
+            errors[i] = 0;
+    }
+};
+
+class Client {
+ private:
+    int fd_;
+    std::vector<char> buffer_;
+    size_t offset_;
+
+    void read_object(msgpack::object_handle* into);
+
+ public:
+    explicit Client(const Config& config);
+    ~Client();
+    void send(const msgpack::sbuffer& request);
+    // reads a reply with all its rows, returns its status
+    int reply();
+};
+
+void connect_unix(int fd, const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() > sizeof(addr.sun_path) - 1)
+        throw std::runtime_error("Socket path too long: " + path);
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + path.size();
+    // a leading @ names a socket in the abstract namespace
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        addr_len += 1;
+    if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr), addr_len) != 0)
+        throw std::runtime_error("Failed to connect to " + path + ": " +
+                                 std::strerror(errno));
+}
+
+Client::Client(const Config& config): offset_(0) {
+    if (!config.unix_path.empty()) {
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ == -1)
+            throw std::runtime_error(std::strerror(errno));
+        try {
+            connect_unix(fd_, config.unix_path);
+        } catch (std::runtime_error& e) {
+            close(fd_);
+            throw;
+        }
+        return;
+    }
+    const std::string& host = config.host;
+    const std::string& port = config.port;
+    struct addrinfo hints;
+    struct addrinfo* addr_infos;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addr_infos);
+    if (ret != 0)
+        throw std::runtime_error(gai_strerror(ret));
+    fd_ = -1;
+    for (auto aip = addr_infos; aip != NULL; aip = aip->ai_next) {
+        fd_ = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+        if (fd_ == -1)
+            continue;
+        if (connect(fd_, aip->ai_addr, aip->ai_addrlen) == 0) {
+            // requests are small and sent whole, never wait to coalesce them
+            int nodelay = 1;
+            setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            break;
+        }
+        close(fd_);
+        fd_ = -1;
+    }
+    freeaddrinfo(addr_infos);
+    if (fd_ == -1)
+        throw std::runtime_error("Failed to connect to " + host + ":" + port);
+}
+
+Client::~Client() {
+    if (fd_ != -1)
+        close(fd_);
+}
+
+void Client::send(const msgpack::sbuffer& request) {
+    const char* data = request.data();
+    size_t left = request.size();
+    while (left > 0) {
+        ssize_t sent = ::send(fd_, data, left, MSG_NOSIGNAL);
+        if (sent == -1)
+            throw std::runtime_error(std::strerror(errno));
+        data += sent;
+        left -= sent;
+    }
+}
+
+void Client::read_object(msgpack::object_handle* into) {
+    while (true) {
+        size_t next = offset_;
+        try {
+            msgpack::unpack(*into, buffer_.data(), buffer_.size(), next);
+            offset_ = next;
+            return;
+        } catch (msgpack::insufficient_bytes& e) {
+            // drop what was consumed already before reading more
+            buffer_.erase(buffer_.begin(), buffer_.begin() + offset_);
+            offset_ = 0;
+        }
+        size_t size = buffer_.size();
+        buffer_.resize(size + RECV_SIZE);
+        ssize_t received = ::recv(fd_, buffer_.data() + size, RECV_SIZE, 0);
+        if (received <= 0) {
+            buffer_.resize(size);
+            throw std::runtime_error("Connection closed by server.");
+        }
+        buffer_.resize(size + received);
+    }
+}
+
+int Client::reply() {
+    msgpack::object_handle header;
+    read_object(&header);
+    const msgpack::object& map = header.get();
+    if (map.type != msgpack::type::MAP)
+        throw std::runtime_error("Reply header is not a map.");
+    int64_t status = -1;
+    int64_t rowcount = 0;
+    bool has_columns = false;
+    bool is_cursor = false;
+    for (uint32_t i = 0; i < map.via.map.size; ++i) {
+        const msgpack::object_kv& kv = map.via.map.ptr[i];
+        std::string key(kv.key.via.str.ptr, kv.key.via.str.size);
+        if (key == "status")
+            status = kv.val.via.i64;
+        else if (key == "rowcount" && kv.val.type != msgpack::type::NIL)
+            rowcount = kv.val.via.i64;
+        else if (key == "columns")
+            has_columns = (kv.val.type != msgpack::type::NIL);
+        else if (key == "cursor")
+            is_cursor = true;
+    }
+    // rows follow the header only for successful queries returning columns
+    if (status == 0 && has_columns && !is_cursor) {
+        msgpack::object_handle row;
+        for (int64_t i = 0; i < rowcount; ++i)
+            read_object(&row);
+    }
+    return static_cast<int>(status);
+}
+
+void pack_str(Packer* packer, const std::string& str) {
+    packer->pack(str);
+}
+
+void pack_key(Packer* packer, const Config& config, int key) {
+    if (config.opcodes)
+        packer->pack(key);
+    else
+        pack_str(packer, sqlizator::key_name(key));
+}
+
+void pack_endpoint(Packer* packer, const Config& config, uint8_t opcode) {
+    pack_key(packer, config, sqlizator::request_keys::ENDPOINT);
+    if (config.opcodes)
+        packer->pack(opcode);
+    else
+        pack_str(packer, sqlizator::opcode_name(opcode));
+}
+
+void connect_request(const Config& config, msgpack::sbuffer* buffer) {
+    Packer packer(buffer);
+    packer.pack_map(config.group_commit > 0 ? 5 : 4);
+    pack_endpoint(&packer, config, sqlizator::opcodes::CONNECT);
+    pack_key(&packer, config, sqlizator::request_keys::DATABASE);
+    pack_str(&packer, DATABASE);
+    pack_key(&packer, config, sqlizator::request_keys::PATH);
+    pack_str(&packer, config.path);
+    pack_str(&packer, "journal_mode");
+    pack_str(&packer, "WAL");
+    if (config.group_commit > 0) {
+        pack_str(&packer, "group_commit_size");
+        pack_str(&packer, std::to_string(config.group_commit));
+    }
+}
+
+void query_request(const Config& config,
+                   const std::string& query,
+                   const std::vector<int64_t>& parameters,
+                   msgpack::sbuffer* buffer) {
+    Packer packer(buffer);
+    packer.pack_map(5);
+    pack_endpoint(&packer, config, sqlizator::opcodes::QUERY);
+    pack_key(&packer, config, sqlizator::request_keys::DATABASE);
+    pack_str(&packer, DATABASE);
+    pack_key(&packer, config, sqlizator::request_keys::QUERY);
+    pack_str(&packer, query);
+    pack_key(&packer, config, sqlizator::request_keys::OPERATION);
+    packer.pack(2);
+    pack_key(&packer, config, sqlizator::request_keys::PARAMETERS);
+    packer.pack(parameters);
+}
+
+void executemany_request(const Config& config,
+                         const std::string& query,
+                         int first,
+                         int count,
+                         msgpack::sbuffer* buffer) {
+    Packer packer(buffer);
+    packer.pack_map(4);
+    pack_endpoint(&packer, config, sqlizator::opcodes::EXECUTEMANY);
+    pack_key(&packer, config, sqlizator::request_keys::DATABASE);
+    pack_str(&packer, DATABASE);
+    pack_key(&packer, config, sqlizator::request_keys::QUERY);
+    pack_str(&packer, query);
+    pack_key(&packer, config, sqlizator::request_keys::PARAMETERS);
+    packer.pack_array(count);
+    for (int i = first; i < first + count; ++i) {
+        packer.pack_array(3);
+        packer.pack(i);
+        pack_str(&packer, "name-" + std::to_string(i));
+        packer.pack(i * 0.5);
+    }
+}
+
+void call(Client* client, const msgpack::sbuffer& request) {
+    client->send(request);
+    if (client->reply() != 0)
+        throw std::runtime_error("Setup request failed.");
+}
+
+void setup(const Config& config) {
+    Client client(config);
+    msgpack::sbuffer buffer;
+    connect_request(config, &buffer);
+    call(&client, buffer);
+    const char* statements[] = {
+        "DROP TABLE IF EXISTS bench;",
+        "DROP TABLE IF EXISTS bench_writes;",
+        "CREATE TABLE bench (id INTEGER PRIMARY KEY, name TEXT, value REAL);",
+        "CREATE TABLE bench_writes (id INTEGER, name TEXT, value REAL);"
+    };
+    for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); ++i) {
+        buffer.clear();
+        query_request(config, statements[i], std::vector<int64_t>(), &buffer);
+        call(&client, buffer);
+    }
+    for (int i = 0; i < config.table_rows; i += SETUP_CHUNK) {
+        int count = std::min<int>(SETUP_CHUNK, config.table_rows - i);
+        buffer.clear();
+        executemany_request(config,
+                            "INSERT INTO bench VALUES (?, ?, ?);",
+                            i,
+                            count,
+                            &buffer);
+        call(&client, buffer);
+    }
+}
+
+RequestType pick(const Config& config, std::mt19937* rng) {
+    int total = 0;
+    for (int i = 0; i < REQUEST_TYPES; ++i)
+        total += config.weights[i];
+    int roll = std::uniform_int_distribution<int>(0, total - 1)(*rng);
+    for (int i = 0; i < REQUEST_TYPES; ++i) {
+        if (roll < config.weights[i])
+            return static_cast<RequestType>(i);
+        roll -= config.weights[i];
+    }
+    return QUERY;
+}
+
+void run_connection(const Config& config,
+                    int index,
+                    Clock::time_point start,
+                    Results* results) {
+    std::mt19937 rng(config.seed + index);
+    std::uniform_int_distribution<int> ids(0, std::max(config.table_rows - 1,
+                                                       0));
+    Client client(config);
+    msgpack::sbuffer buffer;
+    Clock::time_point measure_from = start + std::chrono::seconds(config.warmup);
+    Clock::time_point end = measure_from + std::chrono::seconds(config.duration);
+    // time between two requests of this connection in the open loop mode
+    std::chrono::nanoseconds interval(0);
+    if (config.rate > 0)
+        interval = std::chrono::nanoseconds(
+                static_cast<int64_t>(1e9 * config.connections / config.rate));
+    Clock::time_point due = start;
+    int written = 0;
+    while (true) {
+        if (config.rate > 0) {
+            due += interval;
+            std::this_thread::sleep_until(due);
+        } else {
+            due = Clock::now();
+        }
+        if (due >= end)
+            break;
+        RequestType type = pick(config, &rng);
+        buffer.clear();
+        if (type == CONNECT) {
+            connect_request(config, &buffer);
+        } else if (type == QUERY) {
+            std::vector<int64_t> parameters{ids(rng), config.rows};
+            query_request(config,
+                          "SELECT id, name, value FROM bench "
+                          "WHERE id >= ? LIMIT ?;",
+                          parameters,
+                          &buffer);
+        } else if (type == INSERT) {
+            // a single row in a statement of its own
+            int64_t id = index * 1000000 + written;
+            written += 1;
+            std::vector<int64_t> parameters{id, id, id};
+            query_request(config,
+                          "INSERT INTO bench_writes VALUES (?, ?, ?);",
+                          parameters,
+                          &buffer);
+        } else {
+            int first = index * 1000000 + written;
+            written += config.batch;
+            executemany_request(config,
+                                "INSERT INTO bench_writes VALUES (?, ?, ?);",
+                                first,
+                                config.batch,
+                                &buffer);
+        }
+        client.send(buffer);
+        int status = client.reply();
+        if (due < measure_from)
+            continue;
+        results->latency[type].record_since(due);
+        if (status != 0)
+            results->errors[type].fetch_add(1);
+    }
+}
+
+bool parse_mix(const std::string& mix, Config* config) {
+    // comma separated name:weight pairs, e.g. query:90,executemany:10
+    for (int i = 0; i < REQUEST_TYPES; ++i)
+        config->weights[i] = 0;
+    std::stringstream stream(mix);
+    std::string item;
+    int total = 0;
+    while (std::getline(stream, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos)
+            return false;
+        std::string name = item.substr(0, colon);
+        int weight = std::atoi(item.substr(colon + 1).c_str());
+        bool found = false;
+        for (int i = 0; i < REQUEST_TYPES; ++i) {
+            if (name == REQUEST_NAMES[i]) {
+                config->weights[i] = weight;
+                found = true;
+            }
+        }
+        if (!found || weight < 0)
+            return false;
+        total += weight;
+    }
+    return total > 0;
+}
+
+void print_usage() {
+    std::cerr << "Usage: loadgen "
+              << "[--host HOST] [--port NUMBER] [--unix PATH] "
+              << "[--connections COUNT] "
+              << "[--duration SECONDS] [--warmup SECONDS] "
+              << "[--rate REQUESTS_PER_SECOND] "
+              << "[--mix query:90,executemany:5,connect:5] "
+              << "[--rows COUNT] [--batch COUNT] [--table-rows COUNT] "
+              << "[--path DATABASE_PATH] [--seed NUMBER] "
+              << "[--group-commit SIZE] [--opcodes 0|1]"
+              << std::endl;
+}
+
+bool parse_args(int argc, char* argv[], ConfMap* into) {
+    for (int i = 1; i < argc; i += 2) {
+        bool matched = false;
+        for (auto it = OPTIONS.begin(); it != OPTIONS.end(); ++it) {
+            if (std::string(argv[i]) == "--" + *it && i + 1 < argc) {
+                (*into)[*it] = std::string(argv[i + 1]);
+                matched = true;
+            }
+        }
+        if (!matched) {
+            print_usage();
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string option(ConfMap* args, const std::string& key,
+                   const std::string& fallback) {
+    auto found = args->find(key);
+    return found != args->end() ? found->second : fallback;
+}
+
+void report(const Config& config, Results* results) {
+    uint64_t total = 0;
+    std::printf("%-12s %10s %8s %10s %10s %10s %10s\n",
+                "request", "count", "errors", "mean_us",
+                "p50_us", "p99_us", "p999_us");
+    for (int i = 0; i < REQUEST_TYPES; ++i) {
+        sqlizator::Histogram& latency = results->latency[i];
+        uint64_t count = latency.count();
+        if (count == 0)
+            continue;
+        total += count;
+        std::printf("%-12s %10llu %8llu %10.1f %10.1f %10.1f %10.1f\n",
+                    REQUEST_NAMES[i],
+                    static_cast<unsigned long long>(count),
+                    static_cast<unsigned long long>(results->errors[i].load()),
+                    latency.mean() / 1000.0,
+                    latency.percentile(0.5) / 1000.0,
+                    latency.percentile(0.99) / 1000.0,
+                    latency.percentile(0.999) / 1000.0);
+    }
+    std::printf("throughput: %.1f requests/s over %d connections (%s)\n",
+                static_cast<double>(total) / config.duration,
+                config.connections,
+                config.rate > 0 ? "open loop" : "closed loop");
+}
+
+int main(int argc, char* argv[]) {
+    ConfMap args;
+    if (!parse_args(argc, argv, &args))
+        return 1;
+    Config config;
+    try {
+        config.host = option(&args, "host", "127.0.0.1");
+        config.port = option(&args, "port", "8080");
+        config.unix_path = option(&args, "unix", "");
+        config.connections = std::stoi(option(&args, "connections", "16"));
+        config.duration = std::stoi(option(&args, "duration", "10"));
+        config.warmup = std::stoi(option(&args, "warmup", "1"));
+        config.rate = std::stod(option(&args, "rate", "0"));
+        config.rows = std::stoi(option(&args, "rows", "10"));
+        config.batch = std::stoi(option(&args, "batch", "10"));
+        config.table_rows = std::stoi(option(&args, "table-rows", "10000"));
+        config.path = option(&args, "path", "/tmp/sqlizator-bench.db");
+        config.seed = std::stoul(option(&args, "seed", "1"));
+        config.group_commit = std::stoi(option(&args, "group-commit", "0"));
+        config.opcodes = std::stoi(option(&args, "opcodes", "0")) != 0;
+    } catch (std::logic_error& e) {
+        print_usage();
+        return 1;
+    }
+    if (!parse_mix(option(&args, "mix", "query:90,executemany:5,connect:5"),
+                   &config) ||
+            config.connections < 1 ||
+            config.duration < 1) {
+        print_usage();
+        return 1;
+    }
+    try {
+        setup(config);
+    } catch (std::exception& e) {
+        std::cerr << "Setup failed: " << e.what() << std::endl;
+        return 1;
+    }
+    Results results;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < config.connections; ++i) {
+        threads.push_back(std::thread([&config, i, start, &results, &failed]() {
+            try {
+                run_connection(config, i, start, &results);
+            } catch (std::exception& e) {
+                std::cerr << "Connection " << i << ": " << e.what()
+                          << std::endl;
+                failed.fetch_add(1);
+            }
+        }));
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    report(config, &results);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,258 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+//
+// In-process benchmarks of result encoding, parameter binding and request
+// decoding, run against synthetic tables of an in-memory database so that
+// neither the disk nor the network is measured.
+#include <sqlite3.h>
+#include <msgpack.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "sqlizator/exceptions.h"
+#include "sqlizator/protocol.h"
+#include "sqlizator/response.h"
+#include "sqlizator/statement.h"
+
+using sqlizator::Packer;
+using sqlizator::Reply;
+using sqlizator::Statement;
+
+typedef std::chrono::steady_clock Clock;
+// runs one iteration and returns the number of items and bytes it processed
+typedef std::function<void(uint64_t* items, uint64_t* bytes)> bench_fn;
+
+static const int DEFAULT_ROWS = 10000;
+// each benchmark repeats until it ran at least this long
+static const double MIN_SECONDS = 1.0;
+
+struct Benchmark {
+    std::string name;
+    std::string unit;
+    bench_fn fn;
+};
+
+void exec(sqlite3* db, const std::string& query) {
+    char* error = NULL;
+    if (sqlite3_exec(db, query.c_str(), NULL, NULL, &error) != SQLITE_OK) {
+        std::string msg(error);
+        sqlite3_free(error);
+        throw sqlizator::sqlite_error(msg);
+    }
+}
+
+void create_tables(sqlite3* db, int rows) {
+    std::string count = std::to_string(rows);
+    std::string series = "WITH RECURSIVE s(i) AS (SELECT 1 UNION ALL "
+                         "SELECT i + 1 FROM s WHERE i < " + count + ") ";
+    exec(db, "CREATE TABLE ints (a INTEGER, b INTEGER, c INTEGER, d INTEGER);");
+    exec(db, "INSERT INTO ints " + series +
+             "SELECT i, i * 7, i * 131, -i FROM s;");
+    exec(db, "CREATE TABLE texts (a TEXT, b TEXT, c TEXT);");
+    exec(db, "INSERT INTO texts " + series +
+             "SELECT hex(randomblob(16)), hex(randomblob(16)), "
+             "hex(randomblob(16)) FROM s;");
+    exec(db, "CREATE TABLE blobs (a BLOB);");
+    exec(db, "INSERT INTO blobs " + series + "SELECT randomblob(1024) FROM s;");
+    exec(db, "CREATE TABLE mixed (id INTEGER, name TEXT, value REAL, "
+             "data BLOB, missing);");
+    exec(db, "INSERT INTO mixed " + series +
+             "SELECT i, 'name-' || i, i * 0.5, randomblob(64), NULL FROM s;");
+    exec(db, "CREATE TABLE sink (a INTEGER, b REAL, c TEXT, d BLOB);");
+}
+
+bench_fn encode(sqlite3* db,
+                const std::string& table,
+                sqlizator::ResultFormat format = sqlizator::ROWS) {
+    std::shared_ptr<Statement> stmt(
+            new Statement(db, "SELECT * FROM " + table + ";"));
+    std::shared_ptr<Reply> reply(new Reply());
+    return [stmt, reply, format](uint64_t* items, uint64_t* bytes) {
+        reply->clear();
+        *items = stmt->execute(&reply->header, &reply->data, true, format);
+        *bytes = reply->header_buf.size() + reply->data_buf.size();
+        stmt->reset();
+    };
+}
+
+bench_fn bind(sqlite3* db, const std::string& query, msgpack::sbuffer* params) {
+    std::shared_ptr<Statement> stmt(new Statement(db, query));
+    std::shared_ptr<msgpack::object_handle> handle(new msgpack::object_handle());
+    msgpack::unpack(*handle, params->data(), params->size());
+    return [stmt, handle](uint64_t* items, uint64_t* bytes) {
+        // bind alone, the statement is never stepped
+        for (int i = 0; i < 1000; ++i) {
+            stmt->bind(handle->get());
+            stmt->reset();
+        }
+        *items = 1000;
+        *bytes = 0;
+    };
+}
+
+bool reference_all(msgpack::type::object_type, size_t, void*) {
+    return true;
+}
+
+bench_fn decode(const std::shared_ptr<msgpack::sbuffer>& request) {
+    std::shared_ptr<msgpack::zone> zone(new msgpack::zone());
+    std::shared_ptr<sqlizator::RequestFields> fields(
+                                            new sqlizator::RequestFields());
+    return [request, zone, fields](uint64_t* items, uint64_t* bytes) {
+        // unpacked and decoded the way the server does it, including the
+        // reuse of the zone and of the decoded fields
+        for (int i = 0; i < 1000; ++i) {
+            size_t offset = 0;
+            bool referenced;
+            msgpack::object object = msgpack::unpack(*zone,
+                                                     request->data(),
+                                                     request->size(),
+                                                     offset,
+                                                     referenced,
+                                                     reference_all);
+            sqlizator::decode_request(object, fields.get());
+            zone->clear();
+        }
+        *items = 1000;
+        *bytes = 1000 * request->size();
+    };
+}
+
+// a small query, either with named or with numbered keys
+std::shared_ptr<msgpack::sbuffer> query_request(bool opcodes) {
+    using sqlizator::request_keys::DATABASE;
+    using sqlizator::request_keys::ENDPOINT;
+    using sqlizator::request_keys::OPERATION;
+    using sqlizator::request_keys::PARAMETERS;
+    using sqlizator::request_keys::QUERY;
+    std::shared_ptr<msgpack::sbuffer> buffer(new msgpack::sbuffer());
+    Packer packer(buffer.get());
+    int keys[] = {ENDPOINT, DATABASE, QUERY, OPERATION, PARAMETERS};
+    packer.pack_map(5);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        if (opcodes)
+            packer.pack(keys[i]);
+        else
+            packer.pack(std::string(sqlizator::key_name(keys[i])));
+        if (keys[i] == ENDPOINT && opcodes)
+            packer.pack(sqlizator::opcodes::QUERY);
+        else if (keys[i] == ENDPOINT)
+            packer.pack(std::string("query"));
+        else if (keys[i] == DATABASE)
+            packer.pack(std::string("bench"));
+        else if (keys[i] == QUERY)
+            packer.pack(std::string("SELECT a FROM ints WHERE a = ?;"));
+        else if (keys[i] == OPERATION)
+            packer.pack(2);
+        else
+            packer.pack(std::vector<int>(1, 42));
+    }
+    return buffer;
+}
+
+std::vector<Benchmark> benchmarks(sqlite3* db) {
+    std::vector<Benchmark> list;
+    list.push_back({"encode_ints", "row", encode(db, "ints")});
+    list.push_back({"encode_texts", "row", encode(db, "texts")});
+    list.push_back({"encode_blobs", "row", encode(db, "blobs")});
+    list.push_back({"encode_mixed", "row", encode(db, "mixed")});
+    list.push_back({"columnar_ints", "row",
+                    encode(db, "ints", sqlizator::COLUMNAR)});
+    list.push_back({"columnar_mixed", "row",
+                    encode(db, "mixed", sqlizator::COLUMNAR)});
+
+    std::string blob(256, 'x');
+    msgpack::sbuffer positional;
+    Packer array(&positional);
+    array.pack_array(4);
+    array.pack(42);
+    array.pack(3.14);
+    array.pack(std::string("some text value"));
+    array.pack_bin(blob.size());
+    array.pack_bin_body(blob.data(), blob.size());
+    list.push_back({"bind_positional", "bind",
+                    bind(db, "INSERT INTO sink VALUES (?, ?, ?, ?);",
+                         &positional)});
+
+    msgpack::sbuffer named;
+    Packer map(&named);
+    map.pack_map(4);
+    map.pack(std::string("a"));
+    map.pack(42);
+    map.pack(std::string("b"));
+    map.pack(3.14);
+    map.pack(std::string("c"));
+    map.pack(std::string("some text value"));
+    map.pack(std::string("d"));
+    map.pack_bin(blob.size());
+    map.pack_bin_body(blob.data(), blob.size());
+    list.push_back({"bind_named", "bind",
+                    bind(db, "INSERT INTO sink VALUES (:a, :b, :c, :d);",
+                         &named)});
+
+    list.push_back({"decode_named", "req", decode(query_request(false))});
+    list.push_back({"decode_opcodes", "req", decode(query_request(true))});
+    return list;
+}
+
+void run(const Benchmark& benchmark) {
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+    // one untimed iteration warms up the page cache and the allocator
+    benchmark.fn(&items, &bytes);
+    items = bytes = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    while (elapsed < MIN_SECONDS) {
+        uint64_t run_items;
+        uint64_t run_bytes;
+        benchmark.fn(&run_items, &run_bytes);
+        items += run_items;
+        bytes += run_bytes;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    std::printf("%-18s %12.1f ns/%-5s %14.0f %ss/s %10.1f MB/s\n",
+                benchmark.name.c_str(),
+                elapsed * 1e9 / items,
+                benchmark.unit.c_str(),
+                items / elapsed,
+                benchmark.unit.c_str(),
+                bytes / elapsed / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    // an optional argument selects the benchmarks whose name contains it
+    std::string filter = (argc > 1) ? argv[1] : "";
+    int rows = DEFAULT_ROWS;
+    if (const char* env = std::getenv("BENCH_ROWS"))
+        rows = std::atoi(env);
+    sqlite3* db;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+        std::cerr << "Cannot open in-memory database." << std::endl;
+        return 1;
+    }
+    try {
+        create_tables(db, rows);
+        std::vector<Benchmark> list = benchmarks(db);
+        for (auto it = list.begin(); it != list.end(); ++it) {
+            if (it->name.find(filter) != std::string::npos)
+                run(*it);
+        }
+        // statements captured by the benchmarks are finalized with the list
+    } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        sqlite3_close_v2(db);
+        return 1;
+    }
+    sqlite3_close_v2(db);
+    return 0;
+}
@@ -2,28 +2,68 @@
 // Some rights reserved.
 // This software is free software licensed under the terms of GPLv3. See COPYING
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
 #include <array>
 #include <iostream>
 #include <map>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "sqlizator/server.h"
 
 typedef std::map<std::string, std::string> ConfMap;
 
-static const int OPTION_COUNT = 4;
+static const int OPTION_COUNT = 9;
 static const std::array<std::string, OPTION_COUNT> OPTIONS = {
-    "port"
+    "port",
+    "unix",
+    "workers",
+    "reactors",
+    "query-log",
+    "slow-query-log",
+    "slow-query-ms",
+    "max-open-databases",
+    "idle-timeout"
 };
 static const int DEFAULT_PORT = 8080;
 
 void print_usage() {
     std::cerr << "Usage: sqlizator "
               << "[--port NUMBER] "
+              << "[--unix PATH] "
+              << "[--workers COUNT] "
+              << "[--reactors COUNT] "
+              << "[--query-log PATH] "
+              << "[--slow-query-log PATH] "
+              << "[--slow-query-ms MILLISECONDS] "
+              << "[--max-open-databases COUNT] "
+              << "[--idle-timeout SECONDS] "
+              << std::endl;
+    std::cerr << "Queries run on one worker thread per core unless "
+              << "--workers is given, 0 runs them on the network threads."
               << std::endl;
 }
 
+// reads a count option if it was given, std::stoull would silently wrap
+// negative values around instead of rejecting them
+bool parse_count(const ConfMap& args,
+                 const std::string& name,
+                 uint64_t* into) {
+    auto found = args.find(name);
+    if (found == args.end())
+        return true;
+    long long value = std::stoll(found->second);
+    if (value < 0) {
+        std::cerr << "--" + name + " must not be negative." << std::endl;
+        return false;
+    }
+    *into = value;
+    return true;
+}
+
 bool parse_args(int argc, char* argv[], ConfMap* into) {
     for (int i = 1; i < argc; i += 2) {
         bool matched = false;
@@ -49,16 +89,58 @@ bool parse_args(int argc, char* argv[], ConfMap* into) {
 
 int main(int argc, char* argv[]) {
     // prepare default options
-    int port = DEFAULT_PORT;
+    std::string port = std::to_string(DEFAULT_PORT);
+    // queries run on one worker thread per core by default, zero executes
+    // them on the network thread itself, as all versions before the worker
+    // pool did
+    uint64_t workers = std::thread::hardware_concurrency();
+    // network I/O runs on a single event loop thread by default
+    uint64_t reactors = 1;
     // parse command line args
     ConfMap args;
     if (!parse_args(argc, argv, &args))
         return 1;
     // override default options with defined command line arguments
+    // a unix socket replaces the default port, unless one is given as well.
+    // a path starting with @ names a socket in the abstract namespace
+    std::string unix_path;
+    if (args.find("unix") != args.end()) {
+        unix_path = args["unix"];
+        port.clear();
+    }
     if (args.find("port") != args.end())
-        port = std::stoi(args["port"]);
+        port = std::to_string(std::stoi(args["port"]));
+    if (!parse_count(args, "workers", &workers) ||
+            !parse_count(args, "reactors", &reactors))
+        return 1;
+    // both logs are off unless a path is given, "-" logs to stdout
+    uint64_t slow_query_ms = sqlizator::DEFAULT_SLOW_QUERY_MS;
+    if (!parse_count(args, "slow-query-ms", &slow_query_ms))
+        return 1;
+    sqlizator::QueryLog query_log(args["query-log"],
+                                  args["slow-query-log"],
+                                  slow_query_ms);
+    try {
+        query_log.start();
+    } catch (std::runtime_error& e) {
+        std::cerr << "Cannot open query log: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // databases stay open once used, unless limited
+    uint64_t max_open_databases = 0;
+    uint64_t idle_timeout = 0;
+    if (!parse_count(args, "max-open-databases", &max_open_databases) ||
+            !parse_count(args, "idle-timeout", &idle_timeout))
+        return 1;
 
-    sqlizator::DBServer srv(std::to_string(port));
+    sqlizator::DBServer srv(port,
+                            unix_path,
+                            workers,
+                            reactors,
+                            &query_log,
+                            max_open_databases,
+                            idle_timeout * 1000);
     srv.start();
     return 0;
 }
@@ -0,0 +1,479 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <sqlite3.h>
+#include <msgpack.hpp>
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sqlizator/connection.h"
+#include "sqlizator/exceptions.h"
+#include "sqlizator/querycontrol.h"
+#include "sqlizator/response.h"
+#include "sqlizator/snapshot.h"
+#include "sqlizator/statement.h"
+
+namespace sqlizator {
+
+Connection::Connection(size_t cache_size, QueryLog* log):
+                                                    db_(NULL),
+                                                    statements_(cache_size),
+                                                    log_(log),
+                                                    active_(NULL),
+                                                    in_transaction_(false) {}
+
+Connection::~Connection() {
+    close();
+}
+
+int callback(void *, int, char **, char **) {
+    return 0;
+}
+
+// points the profile callback at the statement being stepped for as long
+// as it is in scope
+struct Profiled {
+    Statement** active;
+
+    Profiled(Statement** active, Statement* stmt): active(active) {
+        *active = stmt;
+    }
+    ~Profiled() {
+        *active = NULL;
+    }
+};
+
+int Connection::profile(unsigned /* type */,
+                        void* context,
+                        void* p,
+                        void* x) {
+    Connection* conn = static_cast<Connection*>(context);
+    sqlite3_stmt* stmt = static_cast<sqlite3_stmt*>(p);
+    uint64_t duration_ns = *static_cast<sqlite3_uint64*>(x);
+    uint64_t rows = 0;
+    uint64_t bytes = 0;
+    // statements sqlite runs internally, like the ones of exec, are not
+    // wrapped and return no rows to the client
+    if (conn->active_ != NULL && conn->active_->handle() == stmt) {
+        rows = conn->active_->rows();
+        bytes = conn->active_->bytes();
+    }
+    conn->log_->record(conn->path_,
+                       sqlite3_sql(stmt),
+                       duration_ns,
+                       rows,
+                       bytes);
+    return 0;
+}
+
+void Connection::open(const std::string& path, int flags) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int ret = sqlite3_open_v2(path.c_str(), &db_, flags, NULL);
+    if (ret != SQLITE_OK) {
+        std::string extended(sqlite3_errmsg(db_));
+        sqlite3_close(db_);
+        db_ = NULL;
+        throw sqlite_error(sqlite3_errstr(ret), extended);
+    }
+    path_ = path;
+    // lets the deadline or cancellation of a request stop its statements
+    sqlite3_progress_handler(db_,
+                             PROGRESS_CHECK_INTERVAL,
+                             &QueryControl::progress,
+                             NULL);
+    sqlite3_set_authorizer(db_, &Statement::authorize, NULL);
+    // without a log sqlite does not even measure the statements
+    if (log_ != NULL && log_->enabled())
+        sqlite3_trace_v2(db_, SQLITE_TRACE_PROFILE, &Connection::profile, this);
+}
+
+void Connection::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // all cached statements are finalized now, while the handle is kept as a
+    // zombie until the statements of open cursors are finalized as well
+    statements_.clear();
+    sqlite3_close_v2(db_);
+    db_ = NULL;
+}
+
+void Connection::load(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sqlite3* file = NULL;
+    int ret = sqlite3_open_v2(path.c_str(), &file, SQLITE_OPEN_READONLY, NULL);
+    if (ret == SQLITE_CANTOPEN) {
+        // nothing was saved there yet
+        sqlite3_close(file);
+        return;
+    }
+    if (ret != SQLITE_OK) {
+        std::string extended(sqlite3_errmsg(file));
+        sqlite3_close(file);
+        throw sqlite_error(sqlite3_errstr(ret), extended);
+    }
+    sqlite3_backup* backup = sqlite3_backup_init(db_, "main", file, "main");
+    if (backup == NULL) {
+        std::string extended(sqlite3_errmsg(db_));
+        sqlite3_close(file);
+        throw sqlite_error(sqlite3_errstr(sqlite3_errcode(db_)), extended);
+    }
+    ret = sqlite3_backup_step(backup, -1);
+    int finished = sqlite3_backup_finish(backup);
+    sqlite3_close(file);
+    if (ret != SQLITE_DONE)
+        throw sqlite_error(sqlite3_errstr(ret), path);
+    if (finished != SQLITE_OK)
+        throw sqlite_error(sqlite3_errstr(finished), sqlite3_errmsg(db_));
+}
+
+int Connection::snapshot_step(Snapshot* snapshot, int pages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return snapshot->step(db_, pages);
+}
+
+void Connection::exec(const char* query) {
+    int ret = sqlite3_exec(db_, query, callback, 0, NULL);
+    if (ret != SQLITE_OK) {
+        throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+    }
+}
+
+std::unique_ptr<Statement> Connection::acquire(const std::string& query) {
+    return statements_.acquire(db_, query);
+}
+
+void Connection::recycle(const std::string& query,
+                         std::unique_ptr<Statement> stmt) {
+    if (log_ != NULL) {
+        // a statement that did not run to completion is profiled when it is
+        // reset, which has to happen while it is still the active one
+        stmt->reset();
+        active_ = NULL;
+    }
+    statements_.release(query, std::move(stmt));
+}
+
+void Connection::pragma(const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string query("PRAGMA " + key + "=" + value + ";");
+    exec(query.c_str());
+}
+
+int value_callback(void* into, int count, char** values, char**) {
+    if (count > 0 && values[0] != NULL)
+        *static_cast<std::string*>(into) = values[0];
+    return 0;
+}
+
+std::string Connection::pragma(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string query("PRAGMA " + key + ";");
+    std::string value;
+    int ret = sqlite3_exec(db_, query.data(), value_callback, &value, NULL);
+    if (ret != SQLITE_OK) {
+        throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+    }
+    return value;
+}
+
+StatementTraits Connection::classify(const std::string& query) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    // the statement is kept cached, as it will likely be executed here
+    std::unique_ptr<Statement> stmt(acquire(query));
+    StatementTraits result = stmt->traits();
+    recycle(query, std::move(stmt));
+    return result;
+}
+
+bool Connection::in_transaction() {
+    return in_transaction_;
+}
+
+bool Connection::data_version(int64_t* version) {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    if (!lock.owns_lock() || db_ == NULL)
+        return false;
+    std::string value;
+    int ret = sqlite3_exec(db_,
+                           "PRAGMA data_version;",
+                           value_callback,
+                           &value,
+                           NULL);
+    if (ret != SQLITE_OK || value.empty())
+        return false;
+    *version = std::stoll(value);
+    return true;
+}
+
+void Connection::query(Operation operation,
+                       const std::string& query,
+                       const msgpack::object& parameters,
+                       ResultFormat format,
+                       Packer* header,
+                       Packer* data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // the database may have been dropped while the request was waiting
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    std::unique_ptr<Statement> stmt(acquire(query));
+    Profiled profiled(&active_, stmt.get());
+    bool collect_result = (operation == Operation::EXECUTE_AND_FETCH);
+    try {
+        stmt->bind(parameters);
+        stmt->execute(header, data, collect_result, format);
+    } catch (sqlite_error& e) {
+        recycle(query, std::move(stmt));
+        in_transaction_ = !sqlite3_get_autocommit(db_);
+        throw;
+    }
+    recycle(query, std::move(stmt));
+    in_transaction_ = !sqlite3_get_autocommit(db_);
+}
+
+std::unique_ptr<Statement> Connection::query_cursor(
+                                    const std::string& query,
+                                    const msgpack::object& parameters,
+                                    uint64_t count,
+                                    ResultFormat format,
+                                    Packer* header,
+                                    Packer* data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    std::unique_ptr<Statement> stmt(acquire(query));
+    Profiled profiled(&active_, stmt.get());
+    bool done;
+    try {
+        // the statement is kept for later fetches, past the lifetime of the
+        // request its parameters came from
+        stmt->bind(parameters, true);
+        stmt->add_columns_meta_info(header);
+        uint64_t rowcount = stmt->fetch(data, count, &done, format);
+        pack_key(header, header_keys::ROWCOUNT);
+        header->pack(rowcount);
+    } catch (sqlite_error& e) {
+        recycle(query, std::move(stmt));
+        in_transaction_ = !sqlite3_get_autocommit(db_);
+        throw;
+    }
+    in_transaction_ = !sqlite3_get_autocommit(db_);
+    if (done) {
+        recycle(query, std::move(stmt));
+        return std::unique_ptr<Statement>();
+    }
+    // more rows remain, the statement stays suspended and out of the cache
+    return stmt;
+}
+
+uint64_t Connection::fetch(Statement* stmt,
+                           uint64_t count,
+                           ResultFormat format,
+                           Packer* data,
+                           bool* done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    Profiled profiled(&active_, stmt);
+    return stmt->fetch(data, count, done, format);
+}
+
+uint64_t Connection::execute_many(const std::string& query,
+                                  const msgpack::object& parameter_sets,
+                                  int64_t* failed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    *failed = -1;
+    std::unique_ptr<Statement> stmt(acquire(query));
+    Profiled profiled(&active_, stmt.get());
+    // a savepoint starts a transaction of its own if none is open yet, or
+    // nests into the one the client has started
+    exec("SAVEPOINT executemany;");
+    uint64_t changes = 0;
+    uint32_t i = 0;
+    try {
+        for (; i < parameter_sets.via.array.size; ++i) {
+            stmt->bind(parameter_sets.via.array.ptr[i]);
+            changes += stmt->execute();
+            stmt->reset();
+        }
+        i = parameter_sets.via.array.size;
+        exec("RELEASE executemany;");
+    } catch (sqlite_error& e) {
+        if (i < parameter_sets.via.array.size)
+            *failed = i;
+        recycle(query, std::move(stmt));
+        // the rollback must not be interrupted like the failed statement
+        QueryControl::Scope unchecked(NULL);
+        sqlite3_exec(db_, "ROLLBACK TO executemany;", NULL, NULL, NULL);
+        sqlite3_exec(db_, "RELEASE executemany;", NULL, NULL, NULL);
+        in_transaction_ = !sqlite3_get_autocommit(db_);
+        throw;
+    }
+    recycle(query, std::move(stmt));
+    in_transaction_ = !sqlite3_get_autocommit(db_);
+    return changes;
+}
+
+void Connection::batch(const BatchItem* items,
+                       size_t count,
+                       bool immediate,
+                       msgpack::sbuffer* results,
+                       int64_t* failed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    *failed = -1;
+    // nest into the transaction of the client if it has started one
+    bool nested = in_transaction_;
+    if (nested)
+        exec("SAVEPOINT batch;");
+    else
+        exec(immediate ? "BEGIN IMMEDIATE;" : "BEGIN DEFERRED;");
+    size_t i = 0;
+    // the item header is only complete once all rows were stepped through,
+    // so both parts are packed separately first, into buffers shared by all
+    // items of the batch
+    Reply item_reply;
+    try {
+        for (; i < count; ++i) {
+            const BatchItem& item = items[i];
+            item_reply.clear();
+            item_reply.header.pack_map(header_sizes::BATCH_ITEM);
+            std::unique_ptr<Statement> stmt(acquire(item.query));
+            Profiled profiled(&active_, stmt.get());
+            try {
+                stmt->bind(item.parameters);
+                stmt->execute(&item_reply.header,
+                              &item_reply.data,
+                              item.operation == Operation::EXECUTE_AND_FETCH);
+            } catch (sqlite_error& e) {
+                recycle(item.query, std::move(stmt));
+                throw;
+            }
+            recycle(item.query, std::move(stmt));
+            results->write(item_reply.header_buf.data(),
+                           item_reply.header_buf.size());
+            results->write(item_reply.data_buf.data(),
+                           item_reply.data_buf.size());
+        }
+        i = count;
+        exec(nested ? "RELEASE batch;" : "COMMIT;");
+    } catch (sqlite_error& e) {
+        if (i < count)
+            *failed = i;
+        QueryControl::Scope unchecked(NULL);
+        if (nested) {
+            sqlite3_exec(db_, "ROLLBACK TO batch;", NULL, NULL, NULL);
+            sqlite3_exec(db_, "RELEASE batch;", NULL, NULL, NULL);
+        } else if (!sqlite3_get_autocommit(db_)) {
+            sqlite3_exec(db_, "ROLLBACK;", NULL, NULL, NULL);
+        }
+        in_transaction_ = !sqlite3_get_autocommit(db_);
+        throw;
+    }
+    in_transaction_ = !sqlite3_get_autocommit(db_);
+}
+
+void Connection::commit_group(const std::vector<GroupedWrite*>& writes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (db_ == NULL)
+        throw sqlite_error("Database is closed.");
+    // the transaction is not bound to the deadline of any single request
+    QueryControl::Scope unchecked(NULL);
+    // a transaction may have been started since the writes were queued,
+    // they become part of it then, as they would have on their own
+    bool nested = in_transaction_;
+    if (nested)
+        exec("SAVEPOINT group_commit;");
+    else
+        exec("BEGIN IMMEDIATE;");
+    try {
+        for (auto it = writes.begin(); it != writes.end(); ++it) {
+            GroupedWrite* write = *it;
+            exec("SAVEPOINT grouped_write;");
+            try {
+                std::unique_ptr<Statement> stmt(acquire(*write->query));
+                Profiled profiled(&active_, stmt.get());
+                bool collect_result =
+                        (write->operation == Operation::EXECUTE_AND_FETCH);
+                try {
+                    // stopped by the deadline of its own request
+                    QueryControl::Scope scope(write->control);
+                    stmt->bind(*write->parameters);
+                    stmt->execute(write->header,
+                                  write->data,
+                                  collect_result,
+                                  write->format);
+                } catch (sqlite_error& e) {
+                    recycle(*write->query, std::move(stmt));
+                    throw;
+                }
+                recycle(*write->query, std::move(stmt));
+            } catch (sqlite_error& e) {
+                write->error = std::current_exception();
+            }
+            if (write->error) {
+                sqlite3_exec(db_, "ROLLBACK TO grouped_write;", NULL, NULL, NULL);
+                // some errors roll back the whole transaction, taking the
+                // writes before this one with it
+                if (sqlite3_get_autocommit(db_))
+                    throw sqlite_error("Group commit rolled back.");
+            }
+            exec("RELEASE grouped_write;");
+        }
+        exec(nested ? "RELEASE group_commit;" : "COMMIT;");
+    } catch (sqlite_error& e) {
+        if (nested) {
+            sqlite3_exec(db_, "ROLLBACK TO group_commit;", NULL, NULL, NULL);
+            sqlite3_exec(db_, "RELEASE group_commit;", NULL, NULL, NULL);
+        } else if (!sqlite3_get_autocommit(db_)) {
+            sqlite3_exec(db_, "ROLLBACK;", NULL, NULL, NULL);
+        }
+        in_transaction_ = !sqlite3_get_autocommit(db_);
+        throw;
+    }
+    in_transaction_ = !sqlite3_get_autocommit(db_);
+}
+
+void Connection::release(const std::string& query,
+                         std::unique_ptr<Statement> stmt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // after close the statement is finalized, completing the close
+    Profiled profiled(&active_, stmt.get());
+    if (db_ != NULL)
+        recycle(query, std::move(stmt));
+}
+
+CacheStats Connection::cache_stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statements_.stats();
+}
+
+int64_t db_status(sqlite3* db, int op) {
+    int current = 0;
+    int highwater = 0;
+    sqlite3_db_status(db, op, &current, &highwater, 0);
+    return current;
+}
+
+ConnectionStatus Connection::status() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ConnectionStatus status = {0, 0, 0, 0, 0};
+    if (db_ == NULL)
+        return status;
+    status.cache_used = db_status(db_, SQLITE_DBSTATUS_CACHE_USED);
+    status.schema_used = db_status(db_, SQLITE_DBSTATUS_SCHEMA_USED);
+    status.statements_used = db_status(db_, SQLITE_DBSTATUS_STMT_USED);
+    status.cache_hits = db_status(db_, SQLITE_DBSTATUS_CACHE_HIT);
+    status.cache_misses = db_status(db_, SQLITE_DBSTATUS_CACHE_MISS);
+    return status;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,143 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_CONNECTION_H_
+#define SQLIZATOR_SQLIZATOR_CONNECTION_H_
+#include <sqlite3.h>
+#include <msgpack.hpp>
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sqlizator/querycontrol.h"
+#include "sqlizator/querylog.h"
+#include "sqlizator/response.h"
+#include "sqlizator/snapshot.h"
+#include "sqlizator/statement.h"
+#include "sqlizator/statementcache.h"
+
+namespace sqlizator {
+
+enum Operation {
+    EXECUTE = 1,
+    EXECUTE_AND_FETCH = 2
+};
+
+// a single statement of a batch, its parameters are owned by the request
+struct BatchItem {
+    std::string query;
+    Operation operation;
+    msgpack::object parameters;
+
+    BatchItem(): operation(Operation::EXECUTE) {}
+    // resets all fields, but the query keeps its storage
+    void clear() {
+        query.clear();
+        operation = Operation::EXECUTE;
+        parameters = msgpack::object();
+    }
+};
+
+// a single statement committed together with those of other requests, its
+// query, parameters and reply are owned by the request waiting for it
+struct GroupedWrite {
+    Operation operation;
+    const std::string* query;
+    const msgpack::object* parameters;
+    ResultFormat format;
+    Packer* header;
+    Packer* data;
+    QueryControl* control;
+    // set if the statement failed, or the whole group could not commit
+    std::exception_ptr error;
+    bool done;
+};
+
+// memory and page cache figures reported by sqlite3_db_status
+struct ConnectionStatus {
+    int64_t cache_used;
+    int64_t schema_used;
+    int64_t statements_used;
+    int64_t cache_hits;
+    int64_t cache_misses;
+};
+
+// A single sqlite connection with its own prepared statement cache. Any
+// thread may use it, but only one at a time.
+class Connection {
+ private:
+    sqlite3* db_;
+    std::string path_;
+    StatementCache statements_;
+    // receives every completed statement if set
+    QueryLog* log_;
+    // the statement currently being stepped, whose row counts are attached
+    // to its profiling entry
+    Statement* active_;
+    std::mutex mutex_;
+    // whether an explicitly started transaction is still open, readable
+    // without taking the lock
+    std::atomic<bool> in_transaction_;
+
+    void exec(const char* query);
+    std::unique_ptr<Statement> acquire(const std::string& query);
+    void recycle(const std::string& query, std::unique_ptr<Statement> stmt);
+    static int profile(unsigned type, void* context, void* p, void* x);
+ public:
+    explicit Connection(size_t cache_size, QueryLog* log = NULL);
+    ~Connection();
+    void open(const std::string& path, int flags);
+    void close();
+    // replaces the content of the database with that of the file, if there
+    // is a file at `path`
+    void load(const std::string& path);
+    // see Snapshot::step, the lock is only held for the one step
+    int snapshot_step(Snapshot* snapshot, int pages);
+    void pragma(const std::string& key, const std::string& value);
+    std::string pragma(const std::string& key);
+    StatementTraits classify(const std::string& query);
+    bool in_transaction();
+    // reads `PRAGMA data_version`, which changes whenever another connection
+    // commits. returns false instead of waiting if the connection is in use
+    bool data_version(int64_t* version);
+    void query(Operation operation,
+               const std::string& query,
+               const msgpack::object& parameters,
+               ResultFormat format,
+               Packer* header,
+               Packer* data);
+    std::unique_ptr<Statement> query_cursor(const std::string& query,
+                                            const msgpack::object& parameters,
+                                            uint64_t count,
+                                            ResultFormat format,
+                                            Packer* header,
+                                            Packer* data);
+    uint64_t fetch(Statement* stmt,
+                   uint64_t count,
+                   ResultFormat format,
+                   Packer* data,
+                   bool* done);
+    uint64_t execute_many(const std::string& query,
+                          const msgpack::object& parameter_sets,
+                          int64_t* failed);
+    void batch(const BatchItem* items,
+               size_t count,
+               bool immediate,
+               msgpack::sbuffer* results,
+               int64_t* failed);
+    // executes the writes in a single transaction, each under a savepoint of
+    // its own, so that a failing one is rolled back alone and reported in
+    // its `error`. throws only if the transaction itself cannot commit
+    void commit_group(const std::vector<GroupedWrite*>& writes);
+    void release(const std::string& query, std::unique_ptr<Statement> stmt);
+    CacheStats cache_stats();
+    ConnectionStatus status();
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_CONNECTION_H_
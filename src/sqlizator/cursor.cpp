@@ -0,0 +1,47 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "sqlizator/connection.h"
+#include "sqlizator/cursor.h"
+#include "sqlizator/response.h"
+#include "sqlizator/statement.h"
+
+namespace sqlizator {
+
+Cursor::Cursor(std::shared_ptr<Connection> connection,
+               const std::string& query,
+               ResultFormat format,
+               std::unique_ptr<Statement> statement):
+                                    connection_(connection),
+                                    query_(query),
+                                    format_(format),
+                                    statement_(std::move(statement)),
+                                    last_used_(std::chrono::steady_clock::now()) {}
+
+Cursor::~Cursor() {
+    connection_->release(query_, std::move(statement_));
+}
+
+uint64_t Cursor::fetch(uint64_t count, Packer* data, bool* done) {
+    // batches of the same cursor must not be fetched in parallel
+    std::lock_guard<std::mutex> lock(mutex_);
+    last_used_ = std::chrono::steady_clock::now();
+    return connection_->fetch(statement_.get(), count, format_, data, done);
+}
+
+bool Cursor::idle_since(std::chrono::steady_clock::time_point since) {
+    std::unique_lock<std::mutex> lock(mutex_, std::try_to_lock);
+    // a cursor being fetched from right now is not idle
+    if (!lock.owns_lock())
+        return false;
+    return last_used_ < since;
+}
+
+}  // namespace sqlizator
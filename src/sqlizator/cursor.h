@@ -0,0 +1,48 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_CURSOR_H_
+#define SQLIZATOR_SQLIZATOR_CURSOR_H_
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "sqlizator/connection.h"
+#include "sqlizator/response.h"
+#include "sqlizator/statement.h"
+
+namespace sqlizator {
+
+static const uint64_t DEFAULT_BATCH_SIZE = 1000;
+static const size_t MAX_OPEN_CURSORS = 1024;
+// cursors abandoned by their clients are closed after this many seconds
+static const int CURSOR_IDLE_TIMEOUT = 300;
+
+// A query suspended between batches of its result set. It keeps its
+// connection alive, and the statement goes back into that connection's
+// cache once the cursor is gone.
+class Cursor {
+ private:
+    std::shared_ptr<Connection> connection_;
+    std::string query_;
+    // every batch is returned in the format of the first one
+    ResultFormat format_;
+    std::unique_ptr<Statement> statement_;
+    std::chrono::steady_clock::time_point last_used_;
+    std::mutex mutex_;
+ public:
+    Cursor(std::shared_ptr<Connection> connection,
+           const std::string& query,
+           ResultFormat format,
+           std::unique_ptr<Statement> statement);
+    ~Cursor();
+    uint64_t fetch(uint64_t count, Packer* data, bool* done);
+    bool idle_since(std::chrono::steady_clock::time_point since);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_CURSOR_H_
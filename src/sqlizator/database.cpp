@@ -3,64 +3,694 @@
 // This software is free software licensed under the terms of GPLv3. See COPYING
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
 #include <sqlite3.h>
+#include <strings.h>
 #include <msgpack.hpp>
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <iostream>
+#include <thread>
 
+#include "sqlizator/connection.h"
+#include "sqlizator/cursor.h"
 #include "sqlizator/database.h"
 #include "sqlizator/exceptions.h"
+#include "sqlizator/handlepool.h"
 #include "sqlizator/response.h"
-#include "sqlizator/statement.h"
+#include "sqlizator/snapshot.h"
+#include "sqlizator/tuning.h"
 
 namespace sqlizator {
 
-Database::Database(const std::string& path): path_(path) {}
+class Database::Use {
+ private:
+    Database* db_;
+
+ public:
+    explicit Use(Database* db): db_(db) {
+        db_->acquire();
+    }
+    ~Use() {
+        db_->release();
+    }
+    Use(const Use&) = delete;
+    Use& operator=(const Use&) = delete;
+};
+
+Database::Database(const std::string& path,
+                   size_t cache_size,
+                   QueryLog* log,
+                   size_t result_cache_size,
+                   HandlePool* handles): path_(path),
+                                         cache_size_(cache_size),
+                                         log_(log),
+                                         handles_(handles),
+                                         open_(false),
+                                         closed_(false),
+                                         users_(0),
+                                         reader_count_(0),
+                                         writer_(new Connection(cache_size, log)),
+                                         reads_(0),
+                                         results_(result_cache_size),
+                                         data_version_(0),
+                                         next_version_check_(0),
+                                         committing_(false),
+                                         group_size_(0),
+                                         group_window_(0),
+                                         groups_(0),
+                                         grouped_writes_(0),
+                                         memory_(false),
+                                         snapshot_interval_(0),
+                                         snapshots_(0),
+                                         snapshot_errors_(0),
+                                         flow_(0) {}
 
 Database::~Database() {
-    sqlite3_close(db_);
+    close();
 }
 
-int callback(void *, int, char **, char **) {
-    return 0;
+void Database::pragma(const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    // remembered to be set again whenever the database is reopened
+    set_pragma(&pragmas_, key, value);
+    if (!open_)
+        return;
+    writer_->pragma(key, value);
+    if (per_connection(key)) {
+        std::lock_guard<std::mutex> readers_lock(readers_mutex_);
+        for (auto it = readers_.begin(); it != readers_.end(); ++it)
+            (*it)->pragma(key, value);
+    }
 }
 
-void Database::pragma(const std::string& key, const std::string& value) {
-    std::string query("PRAGMA " + key + "=" + value + ";");
-    int ret = sqlite3_exec(db_, query.data(), callback, 0, NULL);
-    if (ret != SQLITE_OK) {
-        throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+void Database::configure(Connection* connection) {
+    for (auto it = pragmas_.begin(); it != pragmas_.end(); ++it) {
+        if (per_connection(it->first))
+            connection->pragma(it->first, it->second);
+    }
+}
+
+bool Database::persistent() {
+    // an empty path stands for a temporary database, gone once closed too
+    return !memory_ &&
+           !path_.empty() &&
+           path_ != ":memory:" &&
+           path_.find("mode=memory") == std::string::npos;
+}
+
+void Database::open_connections() {
+    writer_->open(memory_ ? ":memory:" : path_,
+                  SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    open_ = true;
+    try {
+        // an in-memory database starts out as it was last saved
+        if (!snapshot_path_.empty())
+            writer_->load(snapshot_path_);
+        for (auto it = pragmas_.begin(); it != pragmas_.end(); ++it)
+            writer_->pragma(it->first, it->second);
+        open_reader_connections();
+    } catch (sqlite_error& e) {
+        close_connections();
+        throw;
+    }
+    // other processes may have changed it while it was closed
+    results_.invalidate();
+}
+
+void Database::close_connections() {
+    {
+        // wait for queries still running on the readers
+        std::unique_lock<std::mutex> lock(readers_mutex_);
+        readers_cond_.wait(lock, [this] {
+            return idle_readers_.size() == readers_.size();
+        });
+        for (auto it = readers_.begin(); it != readers_.end(); ++it)
+            (*it)->close();
+        idle_readers_.clear();
+        readers_.clear();
+    }
+    // queries waiting for a reader go to the writer instead
+    readers_cond_.notify_all();
+    writer_->close();
+    open_ = false;
+}
+
+void Database::acquire() {
+    bool opened = false;
+    {
+        std::lock_guard<std::mutex> lock(open_mutex_);
+        // it would be created anew if its file was removed with it
+        if (closed_)
+            throw sqlite_error("Database is closed.");
+        if (!open_) {
+            open_connections();
+            opened = true;
+        }
+        users_ += 1;
+    }
+    // in-memory databases are never closed, so they are not counted
+    if (handles_ != NULL && persistent())
+        handles_->touch(this, opened);
+}
+
+void Database::release() {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    users_ -= 1;
+    last_used_ = std::chrono::steady_clock::now();
+}
+
+bool Database::close_if_idle(std::chrono::steady_clock::time_point since) {
+    // a database being opened right now is about to be used
+    std::unique_lock<std::mutex> lock(open_mutex_, std::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+    if (!open_)
+        return true;
+    // a cursor on the writer or a transaction left open by a client would
+    // not survive closing it
+    if (!persistent() ||
+            users_ > 0 ||
+            last_used_ > since ||
+            writer_.use_count() > 1 ||
+            writer_->in_transaction())
+        return false;
+    close_connections();
+    return true;
+}
+
+bool Database::is_open() {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    return open_;
+}
+
+void Database::keep_in_memory(const std::string& snapshot_path,
+                              std::chrono::milliseconds interval) {
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    memory_ = true;
+    snapshot_path_ = snapshot_path;
+    snapshot_interval_ = interval;
+    next_snapshot_ = std::chrono::steady_clock::now() + interval;
+}
+
+void Database::snapshot() {
+    std::lock_guard<std::mutex> lock(snapshot_mutex_);
+    // in-memory databases are open from connect until dropped, and a
+    // dropped one must not be saved again
+    if (snapshot_path_.empty() || !is_open())
+        return;
+    Use use(this);
+    Snapshot copy(snapshot_path_);
+    std::chrono::steady_clock::time_point give_up(
+            std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(SNAPSHOT_BUSY_TIMEOUT));
+    while (true) {
+        int ret = writer_->snapshot_step(&copy, SNAPSHOT_STEP_PAGES);
+        if (ret == SQLITE_DONE)
+            break;
+        if (ret == SQLITE_OK) {
+            // requests waiting for the writer get it in between
+            std::this_thread::yield();
+            continue;
+        }
+        // a transaction is being written, whose changes must not be saved
+        // before it commits
+        if (std::chrono::steady_clock::now() >= give_up)
+            throw sqlite_error(sqlite3_errstr(ret), "Snapshot timed out.");
+        std::this_thread::sleep_for(
+                std::chrono::milliseconds(SNAPSHOT_RETRY_INTERVAL));
+    }
+    snapshots_ += 1;
+    next_snapshot_ = std::chrono::steady_clock::now() + snapshot_interval_;
+}
+
+void Database::snapshot_if_due(std::chrono::steady_clock::time_point now) {
+    {
+        std::lock_guard<std::mutex> lock(snapshot_mutex_);
+        if (snapshot_interval_.count() == 0 || now < next_snapshot_)
+            return;
+        // a failing one is not retried before the next interval either
+        next_snapshot_ = now + snapshot_interval_;
+    }
+    try {
+        snapshot();
+    } catch (sqlite_error& e) {
+        snapshot_errors_ += 1;
+    }
+}
+
+void Database::group_commit(size_t size, std::chrono::microseconds window) {
+    group_size_ = size;
+    group_window_ = window;
+}
+
+// whether a query only changes rows, so it is valid inside a transaction,
+// unlike e.g. VACUUM or the statements controlling transactions
+bool groupable(const std::string& query) {
+    static const char* const keywords[] = {"insert", "update", "delete",
+                                           "replace", NULL};
+    size_t start = query.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return false;
+    for (const char* const* keyword = keywords; *keyword != NULL; ++keyword) {
+        size_t length = std::strlen(*keyword);
+        if (query.size() - start > length &&
+                strncasecmp(query.data() + start, *keyword, length) == 0 &&
+                !std::isalnum(query[start + length]))
+            return true;
+    }
+    return false;
+}
+
+bool Database::known_read_only(const std::string& query) {
+    std::lock_guard<std::mutex> lock(classified_mutex_);
+    auto found = classified_.find(query);
+    return found != classified_.end() && found->second.read_only;
+}
+
+StatementTraits Database::classify(const std::string& query) {
+    {
+        std::lock_guard<std::mutex> lock(classified_mutex_);
+        auto found = classified_.find(query);
+        if (found != classified_.end())
+            return found->second;
+    }
+    // first time seen, let the writer prepare it to find out
+    StatementTraits result = writer_->classify(query);
+    std::lock_guard<std::mutex> lock(classified_mutex_);
+    if (classified_.size() >= MAX_CLASSIFIED_QUERIES)
+        classified_.clear();
+    classified_[query] = result;
+    return result;
+}
+
+bool Database::read_only(const std::string& query) {
+    return classify(query).read_only;
+}
+
+Connection* Database::acquire_reader() {
+    std::unique_lock<std::mutex> lock(readers_mutex_);
+    readers_cond_.wait(lock, [this] {
+        return !idle_readers_.empty() || readers_.empty();
+    });
+    if (readers_.empty())
+        return NULL;
+    Connection* reader = idle_readers_.back();
+    idle_readers_.pop_back();
+    return reader;
+}
+
+void Database::release_reader(Connection* reader) {
+    {
+        std::lock_guard<std::mutex> lock(readers_mutex_);
+        idle_readers_.push_back(reader);
+    }
+    readers_cond_.notify_one();
+}
+
+void Database::commit_next_group(std::unique_lock<std::mutex>* lock) {
+    committing_ = true;
+    if (group_window_.count() > 0)
+        group_cond_.wait_for(*lock, group_window_, [this] {
+            return pending_writes_.size() >= group_size_;
+        });
+    // reused by the groups led by this thread, so it keeps its storage
+    static thread_local std::vector<GroupedWrite*> group;
+    size_t count = std::min(pending_writes_.size(), group_size_);
+    group.assign(pending_writes_.begin(), pending_writes_.begin() + count);
+    pending_writes_.erase(pending_writes_.begin(),
+                          pending_writes_.begin() + count);
+    lock->unlock();
+    try {
+        writer_->commit_group(group);
+    } catch (std::exception& e) {
+        // nothing of the group was committed
+        for (auto it = group.begin(); it != group.end(); ++it) {
+            if (!(*it)->error)
+                (*it)->error = std::current_exception();
+        }
+    }
+    groups_.fetch_add(1, std::memory_order_relaxed);
+    grouped_writes_.fetch_add(count, std::memory_order_relaxed);
+    lock->lock();
+    for (auto it = group.begin(); it != group.end(); ++it)
+        (*it)->done = true;
+    committing_ = false;
+    group_cond_.notify_all();
+}
+
+void Database::grouped_query(Operation operation,
+                             const std::string& query,
+                             const msgpack::object& parameters,
+                             ResultFormat format,
+                             Packer* header,
+                             Packer* data) {
+    GroupedWrite write{operation,
+                       &query,
+                       &parameters,
+                       format,
+                       header,
+                       data,
+                       QueryControl::current(),
+                       std::exception_ptr(),
+                       false};
+    std::unique_lock<std::mutex> lock(group_mutex_);
+    pending_writes_.push_back(&write);
+    // a leader waiting for its group to fill up may go ahead now
+    group_cond_.notify_all();
+    // writes arriving while a group commits make up the next one, led by
+    // whichever of their threads gets there first
+    while (!write.done) {
+        if (committing_)
+            group_cond_.wait(lock);
+        else
+            commit_next_group(&lock);
+    }
+    lock.unlock();
+    if (write.error)
+        std::rethrow_exception(write.error);
+}
+
+void Database::run_query(Operation operation,
+                         const std::string& query,
+                         const msgpack::object& parameters,
+                         ResultFormat format,
+                         Packer* header,
+                         Packer* data) {
+    if (group_size_ > 1 && !writer_->in_transaction() && groupable(query)) {
+        grouped_query(operation, query, parameters, format, header, data);
+        return;
+    }
+    // reads within an open transaction must see its uncommitted changes, so
+    // only the writer can serve them. queries are classified even then, so
+    // that their next requests can be scheduled as reads
+    bool reading = read_only(query);
+    Connection* reader = NULL;
+    if (reading && !writer_->in_transaction())
+        reader = acquire_reader();
+    if (reader == NULL) {
+        writer_->query(operation, query, parameters, format, header, data);
+        return;
+    }
+    reads_.fetch_add(1, std::memory_order_relaxed);
+    try {
+        reader->query(operation, query, parameters, format, header, data);
+    } catch (sqlite_error& e) {
+        release_reader(reader);
+        throw;
     }
+    release_reader(reader);
+}
+
+// appends to a string, so that parameters can be packed into a cache key
+struct KeyBuffer {
+    std::string* key;
+
+    void write(const char* data, size_t size) {
+        key->append(data, size);
+    }
+};
+
+void Database::check_data_version() {
+    // the writer does not see its own commits in its data version, only
+    // those of other processes. it is asked at most once per interval, by
+    // whichever query gets there first
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    int64_t now = duration_cast<milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t due = next_version_check_.load(std::memory_order_relaxed);
+    if (now < due ||
+            !next_version_check_.compare_exchange_strong(
+                    due, now + DATA_VERSION_CHECK_INTERVAL))
+        return;
+    int64_t version;
+    if (!writer_->data_version(&version))
+        return;  // busy, try again with a later query
+    if (data_version_.exchange(version) != version)
+        results_.invalidate();
+}
+
+void Database::cached_query(Operation operation,
+                            const std::string& query,
+                            const msgpack::object& parameters,
+                            ResultFormat format,
+                            Packer* header,
+                            Packer* data) {
+    check_data_version();
+    // reused by the queries of this thread, so it keeps its storage
+    static thread_local std::string key;
+    key.assign(query);
+    key.push_back('\0');
+    key.push_back(static_cast<char>(operation));
+    key.push_back(static_cast<char>(format));
+    KeyBuffer buffer{&key};
+    msgpack::packer<KeyBuffer>(&buffer).pack(parameters);
+    if (results_.lookup(key, header, data))
+        return;
+    uint64_t generation = results_.generation();
+    // kept like the key, a new one would allocate its buffers each time
+    static thread_local Reply result;
+    result.clear();
+    run_query(operation, query, parameters, format, &result.header, &result.data);
+    results_.store(key, generation, result.header_buf, result.data_buf);
+    pack_raw(header, result.header_buf.data(), result.header_buf.size());
+    pack_raw(data, result.data_buf.data(), result.data_buf.size());
 }
 
 void Database::query(Operation operation,
                      const std::string& query,
-                     const msgpack::object_handle& parameters,
+                     const msgpack::object& parameters,
+                     ResultFormat format,
                      Packer* header,
                      Packer* data) {
-    Statement stmt(db_, query, parameters);
-    bool collect_result = (operation == Operation::EXECUTE_AND_FETCH);
-    stmt.execute(header, data, collect_result);
+    Timer timer(&latency_);
+    Use use(this);
+    if (!results_.enabled()) {
+        run_query(operation, query, parameters, format, header, data);
+        return;
+    }
+    // results read inside a transaction may include its own changes, and
+    // those of a statement calling e.g. random() differ from run to run
+    if (!writer_->in_transaction()) {
+        StatementTraits traits = classify(query);
+        if (traits.read_only && traits.deterministic) {
+            cached_query(operation, query, parameters, format, header, data);
+            return;
+        }
+    }
+    // anything else may write, which is only known to be over once the
+    // statement finished, failed or not
+    try {
+        run_query(operation, query, parameters, format, header, data);
+    } catch (sqlite_error& e) {
+        results_.invalidate();
+        throw;
+    }
+    if (!read_only(query))
+        results_.invalidate();
 }
 
-void trace_callback(void* udp, const char* sql) {
-    std::cout << "[SQL] " << sql << std::endl;
+uint64_t Database::execute_many(const std::string& query,
+                                const msgpack::object& parameter_sets,
+                                int64_t* failed) {
+    Timer timer(&latency_);
+    Use use(this);
+    try {
+        uint64_t changes = writer_->execute_many(query, parameter_sets, failed);
+        results_.invalidate();
+        return changes;
+    } catch (sqlite_error& e) {
+        results_.invalidate();
+        throw;
+    }
+}
+
+void Database::batch(const BatchItem* items,
+                     size_t count,
+                     bool immediate,
+                     msgpack::sbuffer* results,
+                     int64_t* failed) {
+    Timer timer(&latency_);
+    Use use(this);
+    try {
+        writer_->batch(items, count, immediate, results, failed);
+    } catch (sqlite_error& e) {
+        results_.invalidate();
+        throw;
+    }
+    results_.invalidate();
+}
+
+std::unique_ptr<Cursor> Database::open_cursor(
+                                    const std::string& query,
+                                    const msgpack::object& parameters,
+                                    uint64_t count,
+                                    ResultFormat format,
+                                    Packer* header,
+                                    Packer* data) {
+    Timer timer(&latency_);
+    Use use(this);
+    std::shared_ptr<Connection> connection(writer_);
+    if (reader_count() > 0 &&
+            !writer_->in_transaction() &&
+            read_only(query)) {
+        // a suspended statement holds on to its read snapshot, which would be
+        // seen by every other query on the same connection, so pooled readers
+        // are not used and the cursor gets a connection of its own instead
+        connection.reset(new Connection(0, log_));
+        connection->open(path_, SQLITE_OPEN_READONLY);
+        std::lock_guard<std::mutex> lock(open_mutex_);
+        configure(connection.get());
+    }
+    std::unique_ptr<Statement> stmt(connection->query_cursor(query,
+                                                             parameters,
+                                                             count,
+                                                             format,
+                                                             header,
+                                                             data));
+    // statements returning rows may still write, that is done by the time
+    // the first row is there
+    if (connection == writer_ && results_.enabled() && !read_only(query))
+        results_.invalidate();
+    if (!stmt)
+        return std::unique_ptr<Cursor>();  // all rows fit in the first batch
+    return std::unique_ptr<Cursor>(new Cursor(connection,
+                                              query,
+                                              format,
+                                              std::move(stmt)));
 }
 
 void Database::connect() {
-    int ret = sqlite3_open(path_.c_str(), &db_);
-    if (ret != SQLITE_OK) {
-        throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+    Use use(this);
+}
+
+void Database::open_readers(size_t count) {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    reader_count_ = count;
+    if (open_)
+        open_reader_connections();
+}
+
+void Database::open_reader_connections() {
+    // without WAL a reader would block the writer and vice versa, so there
+    // would be nothing to gain
+    std::string journal_mode(writer_->pragma("journal_mode"));
+    std::transform(journal_mode.begin(),
+                   journal_mode.end(),
+                   journal_mode.begin(),
+                   ::tolower);
+    if (journal_mode != "wal")
+        return;
+
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    for (size_t i = readers_.size(); i < reader_count_; ++i) {
+        std::unique_ptr<Connection> reader(new Connection(cache_size_, log_));
+        reader->open(path_, SQLITE_OPEN_READONLY);
+        configure(reader.get());
+        idle_readers_.push_back(reader.get());
+        readers_.push_back(std::move(reader));
     }
-    sqlite3_trace(db_, trace_callback, NULL);
 }
 
 void Database::close() {
-    sqlite3_close(db_);
+    // waits for a snapshot in progress, later ones find it closed and do
+    // not open it again
+    std::lock_guard<std::mutex> snapshot_lock(snapshot_mutex_);
+    {
+        std::lock_guard<std::mutex> lock(open_mutex_);
+        closed_ = true;
+        if (open_)
+            close_connections();
+    }
+    // the pool must not be left with a database that may be destroyed
+    if (handles_ != NULL)
+        handles_->forget(this);
 }
 
 std::string Database::path() {
     return path_;
 }
 
+std::string Database::file() {
+    return memory_ ? snapshot_path_ : path_;
+}
+
+std::string Database::snapshot_path() {
+    return snapshot_path_;
+}
+
+void Database::set_flow(uint64_t flow) {
+    flow_ = flow;
+}
+
+uint64_t Database::flow() {
+    return flow_;
+}
+
+size_t Database::reader_count() {
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    return readers_.size();
+}
+
+CacheStats Database::cache_stats() {
+    CacheStats total = writer_->cache_stats();
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    for (auto it = readers_.begin(); it != readers_.end(); ++it) {
+        CacheStats stats = (*it)->cache_stats();
+        total.size += stats.size;
+        total.capacity += stats.capacity;
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+    }
+    return total;
+}
+
+ResultCacheStats Database::result_cache_stats() {
+    return results_.stats();
+}
+
+ConnectionStatus Database::status() {
+    ConnectionStatus total = writer_->status();
+    std::lock_guard<std::mutex> lock(readers_mutex_);
+    for (auto it = readers_.begin(); it != readers_.end(); ++it) {
+        ConnectionStatus status = (*it)->status();
+        total.cache_used += status.cache_used;
+        total.schema_used += status.schema_used;
+        total.statements_used += status.statements_used;
+        total.cache_hits += status.cache_hits;
+        total.cache_misses += status.cache_misses;
+    }
+    return total;
+}
+
+Histogram* Database::latency() {
+    return &latency_;
+}
+
+uint64_t Database::reads() {
+    return reads_.load(std::memory_order_relaxed);
+}
+
+uint64_t Database::groups() {
+    return groups_.load(std::memory_order_relaxed);
+}
+
+uint64_t Database::grouped_writes() {
+    return grouped_writes_.load(std::memory_order_relaxed);
+}
+
+uint64_t Database::snapshots() {
+    return snapshots_.load(std::memory_order_relaxed);
+}
+
+uint64_t Database::snapshot_errors() {
+    return snapshot_errors_.load(std::memory_order_relaxed);
+}
+
 }  // namespace sqlizator
@@ -7,36 +7,227 @@
 #include <sqlite3.h>
 #include <msgpack.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "sqlizator/connection.h"
+#include "sqlizator/cursor.h"
+#include "sqlizator/handlepool.h"
+#include "sqlizator/histogram.h"
+#include "sqlizator/querylog.h"
 #include "sqlizator/response.h"
+#include "sqlizator/resultcache.h"
+#include "sqlizator/statementcache.h"
+#include "sqlizator/tuning.h"
 
 namespace sqlizator {
 
-enum Operation {
-    EXECUTE = 1,
-    EXECUTE_AND_FETCH = 2
-};
-
-const std::vector<std::string> PRAGMAS{"journal_mode", "foreign_keys"};
+static const size_t DEFAULT_READER_COUNT = 4;
+// upper bound of remembered query classifications, ad-hoc queries would
+// otherwise grow it without limit
+static const size_t MAX_CLASSIFIED_QUERIES = 4096;
+// how often, in milliseconds, cached results are checked against changes
+// made by other processes
+static const int DATA_VERSION_CHECK_INTERVAL = 1000;
+// how long, in milliseconds, a snapshot waits between attempts while a
+// transaction is being written, and how long it waits at most
+static const int SNAPSHOT_RETRY_INTERVAL = 10;
+static const int SNAPSHOT_BUSY_TIMEOUT = 5000;
 
-class Database {
+// A named database, served by one connection for writes and, if it is in
+// WAL mode, a pool of read-only connections for queries that only read, so
+// they may run in parallel with each other and with a write. With a handle
+// pool its connections are opened when a request needs them and may be
+// closed again in between, the pragmas and readers it was configured with
+// are restored each time it is opened. A database kept in memory instead
+// is loaded from its snapshot file when opened, and stays open until it
+// is closed for good. Databases are owned by shared_ptrs, through which
+// the handle pool refers to them.
+class Database: public std::enable_shared_from_this<Database> {
  private:
-    sqlite3* db_;
+    // counts a request as using the database for as long as it exists,
+    // opening the database first if needed
+    class Use;
+
     std::string path_;
+    size_t cache_size_;
+    QueryLog* log_;
+    HandlePool* handles_;
+    // guards whether the connections are open and the configuration they
+    // are opened with
+    std::mutex open_mutex_;
+    bool open_;
+    // set by close, requests still holding on to the database must not
+    // open it again
+    bool closed_;
+    size_t users_;
+    std::chrono::steady_clock::time_point last_used_;
+    PragmaList pragmas_;
+    size_t reader_count_;
+    std::shared_ptr<Connection> writer_;
+    std::vector<std::unique_ptr<Connection>> readers_;
+    std::vector<Connection*> idle_readers_;
+    std::mutex readers_mutex_;
+    std::condition_variable readers_cond_;
+    // SQL text mapped to whether it may be executed by a reader, and
+    // whether its results may be cached
+    std::unordered_map<std::string, StatementTraits> classified_;
+    std::mutex classified_mutex_;
+    // time spent executing statements, including waiting for a connection
+    Histogram latency_;
+    std::atomic<uint64_t> reads_;
+    // results of read-only queries, dropped by any write through this
+    // database, or once the writer's data version shows one by another
+    // process. queries that are not deterministic are never cached
+    ResultCache results_;
+    std::atomic<int64_t> data_version_;
+    std::atomic<int64_t> next_version_check_;
+    // writes waiting to be committed together by whichever of their threads
+    // leads the next group, while another group may still be committing
+    std::vector<GroupedWrite*> pending_writes_;
+    bool committing_;
+    size_t group_size_;
+    std::chrono::microseconds group_window_;
+    std::mutex group_mutex_;
+    std::condition_variable group_cond_;
+    std::atomic<uint64_t> groups_;
+    std::atomic<uint64_t> grouped_writes_;
+    // set for databases kept in memory, along with the file they are saved
+    // to, if any
+    bool memory_;
+    std::string snapshot_path_;
+    std::chrono::milliseconds snapshot_interval_;
+    // one snapshot at a time, and none once the database is closed
+    std::mutex snapshot_mutex_;
+    std::chrono::steady_clock::time_point next_snapshot_;
+    std::atomic<uint64_t> snapshots_;
+    std::atomic<uint64_t> snapshot_errors_;
+    // worker pool flow its requests are queued in
+    uint64_t flow_;
+
+    // whether the database survives being closed and opened again, which an
+    // in-memory one does not
+    bool persistent();
+    void open_connections();
+    void close_connections();
+    void open_reader_connections();
+    // applies the pragmas that are set on each connection on its own, with
+    // open_mutex_ held
+    void configure(Connection* connection);
+    void acquire();
+    void release();
+    StatementTraits classify(const std::string& query);
+    bool read_only(const std::string& query);
+    // waits for an idle reader, returns NULL if there are none at all
+    Connection* acquire_reader();
+    void release_reader(Connection* reader);
+    void check_data_version();
+    void commit_next_group(std::unique_lock<std::mutex>* lock);
+    void grouped_query(Operation operation,
+                       const std::string& query,
+                       const msgpack::object& parameters,
+                       ResultFormat format,
+                       Packer* header,
+                       Packer* data);
+    void run_query(Operation operation,
+                   const std::string& query,
+                   const msgpack::object& parameters,
+                   ResultFormat format,
+                   Packer* header,
+                   Packer* data);
+    void cached_query(Operation operation,
+                      const std::string& query,
+                      const msgpack::object& parameters,
+                      ResultFormat format,
+                      Packer* header,
+                      Packer* data);
  public:
-    explicit Database(const std::string& path);
+    explicit Database(const std::string& path,
+                      size_t cache_size = DEFAULT_STATEMENT_CACHE_SIZE,
+                      QueryLog* log = NULL,
+                      size_t result_cache_size = 0,
+                      HandlePool* handles = NULL);
     ~Database();
+    // opens the database right away, to find out whether that is possible
     void connect();
+    void open_readers(size_t count);
+    // closes the database for good, requests using it afterwards fail
     void close();
+    // closes the connections unless a request, a cursor or a transaction
+    // still needs them, or the database was used after `since`. returns
+    // whether it is closed now
+    bool close_if_idle(std::chrono::steady_clock::time_point since);
+    bool is_open();
+    // sets a pragma on the connections it concerns, now if the database is
+    // open and each time it is opened. the value is put into the statement
+    // as it is, see checked_pragma
     void pragma(const std::string& key, const std::string& value);
+    // keeps the database in memory, loaded from `snapshot_path` when opened
+    // and saved back there by `snapshot`, and every `interval` by
+    // `snapshot_if_due` unless that is zero. to be called before it is
+    // opened, an empty path keeps it in memory alone
+    void keep_in_memory(const std::string& snapshot_path,
+                        std::chrono::milliseconds interval);
+    // saves an in-memory database to its snapshot file, a few pages at a
+    // time, so that its requests are served in between. throws sqlite_error
+    void snapshot();
+    // for calling periodically, failures are counted instead of thrown
+    void snapshot_if_due(std::chrono::steady_clock::time_point now);
+    // whether the query is already known to only read, without waiting for
+    // the writer to find out
+    bool known_read_only(const std::string& query);
+    // lets up to `size` single statement writes of concurrent requests share
+    // a transaction, waiting up to `window` for the group to fill. sizes
+    // below 2 disable it
+    void group_commit(size_t size, std::chrono::microseconds window);
     void query(Operation operation,
                const std::string& query,
-               const msgpack::object_handle& parameters,
+               const msgpack::object& parameters,
+               ResultFormat format,
                Packer* header,
                Packer* data);
+    uint64_t execute_many(const std::string& query,
+                          const msgpack::object& parameter_sets,
+                          int64_t* failed);
+    void batch(const BatchItem* items,
+               size_t count,
+               bool immediate,
+               msgpack::sbuffer* results,
+               int64_t* failed);
+    std::unique_ptr<Cursor> open_cursor(const std::string& query,
+                                        const msgpack::object& parameters,
+                                        uint64_t count,
+                                        ResultFormat format,
+                                        Packer* header,
+                                        Packer* data);
     std::string path();
+    // the file the database is kept in, its snapshot file if it is kept in
+    // memory, empty if there is none
+    std::string file();
+    std::string snapshot_path();
+    // to be set before the database is shared with other threads
+    void set_flow(uint64_t flow);
+    uint64_t flow();
+    size_t reader_count();
+    CacheStats cache_stats();
+    ResultCacheStats result_cache_stats();
+    ConnectionStatus status();
+    Histogram* latency();
+    // number of queries served by the read-only connections
+    uint64_t reads();
+    // number of group commits, and of the writes they committed
+    uint64_t groups();
+    uint64_t grouped_writes();
+    // number of snapshots saved, and of the periodic ones that failed
+    uint64_t snapshots();
+    uint64_t snapshot_errors();
 };
 
 }  // namespace sqlizator
@@ -24,6 +24,14 @@ class sqlite_error: public std::runtime_error {
     }
 };
 
+// a statement stopped by its request's deadline or cancellation
+class query_interrupted: public sqlite_error {
+ public:
+    explicit query_interrupted(const std::string& message,
+                               const std::string& extended):
+                                                sqlite_error(message, extended) {}
+};
+
 class invalid_request: public std::runtime_error {
  public:
     explicit invalid_request(const std::string& message):
@@ -0,0 +1,157 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "sqlizator/database.h"
+#include "sqlizator/handlepool.h"
+
+namespace sqlizator {
+
+HandlePool::HandlePool(size_t max_open,
+                       std::chrono::milliseconds idle_timeout):
+                                                max_open_(max_open),
+                                                idle_timeout_(idle_timeout),
+                                                touches_(0),
+                                                opens_(0),
+                                                idle_closes_(0),
+                                                evictions_(0),
+                                                stopping_(false) {
+    // without either there is nothing to check for
+    if (max_open_ > 0 || idle_timeout_.count() > 0)
+        thread_ = std::thread(&HandlePool::run, this);
+}
+
+HandlePool::~HandlePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void HandlePool::touch(Database* db, bool opened) {
+    CandidateList candidates;
+    size_t excess;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(db);
+        if (found == index_.end()) {
+            Entry entry;
+            entry.db = db->shared_from_this();
+            entry.touched = 0;
+            open_.push_front(entry);
+            index_[db] = open_.begin();
+        } else {
+            open_.splice(open_.begin(), open_, found->second);
+        }
+        open_.front().touched = ++touches_;
+        if (!opened)
+            return;
+        opens_ += 1;
+        // the ones in use that were left open are retried by check
+        excess = eviction_candidates(db, &candidates);
+    }
+    close(candidates, std::chrono::steady_clock::now(), excess, &evictions_);
+}
+
+size_t HandlePool::eviction_candidates(const Database* except,
+                                       CandidateList* candidates) {
+    if (max_open_ == 0 || open_.size() <= max_open_)
+        return 0;
+    for (auto it = open_.rbegin(); it != open_.rend(); ++it) {
+        std::shared_ptr<Database> db = it->db.lock();
+        if (db && db.get() != except)
+            candidates->push_back(std::make_pair(db, it->touched));
+    }
+    return open_.size() - max_open_;
+}
+
+void HandlePool::close(const CandidateList& candidates,
+                       std::chrono::steady_clock::time_point since,
+                       size_t limit,
+                       uint64_t* closes) {
+    size_t closed = 0;
+    for (auto it = candidates.begin();
+            it != candidates.end() && closed < limit;
+            ++it) {
+        // waits for nothing, a database being opened is skipped
+        if (!it->first->close_if_idle(since))
+            continue;
+        closed += 1;
+        std::lock_guard<std::mutex> lock(mutex_);
+        *closes += 1;
+        // unless it was opened again meanwhile
+        auto found = index_.find(it->first.get());
+        if (found != index_.end() && found->second->touched == it->second) {
+            open_.erase(found->second);
+            index_.erase(found);
+        }
+    }
+}
+
+void HandlePool::check(std::chrono::steady_clock::time_point now) {
+    CandidateList candidates;
+    if (idle_timeout_.count() > 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto it = open_.rbegin(); it != open_.rend(); ++it) {
+                std::shared_ptr<Database> db = it->db.lock();
+                if (db)
+                    candidates.push_back(std::make_pair(db, it->touched));
+            }
+        }
+        close(candidates, now - idle_timeout_, SIZE_MAX, &idle_closes_);
+        candidates.clear();
+    }
+    size_t excess;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        excess = eviction_candidates(NULL, &candidates);
+    }
+    close(candidates, now, excess, &evictions_);
+}
+
+void HandlePool::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        cond_.wait_for(lock, std::chrono::milliseconds(IDLE_CHECK_INTERVAL));
+        if (stopping_)
+            return;
+        // closing waits for connections, requests must not wait for that
+        lock.unlock();
+        check(std::chrono::steady_clock::now());
+        lock.lock();
+    }
+}
+
+void HandlePool::forget(Database* db) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = index_.find(db);
+    if (found == index_.end())
+        return;
+    open_.erase(found->second);
+    index_.erase(found);
+}
+
+HandleStats HandlePool::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    HandleStats stats;
+    stats.open = open_.size();
+    stats.max_open = max_open_;
+    stats.opens = opens_;
+    stats.idle_closes = idle_closes_;
+    stats.evictions = evictions_;
+    return stats;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,97 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_HANDLEPOOL_H_
+#define SQLIZATOR_SQLIZATOR_HANDLEPOOL_H_
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace sqlizator {
+
+class Database;
+
+// how often, in milliseconds, open databases are checked for having been
+// idle for too long, or for being more than allowed
+static const int IDLE_CHECK_INTERVAL = 1000;
+
+struct HandleStats {
+    uint64_t open;
+    uint64_t max_open;
+    uint64_t opens;
+    uint64_t idle_closes;
+    uint64_t evictions;
+};
+
+// Keeps track of which databases are open, so that their number stays
+// bounded. Databases open themselves when a request uses them and report
+// it here. Opening one closes the least recently used ones beyond the
+// limit, and a thread of the pool's own closes those that were not used
+// for longer than the idle timeout, and those beyond the limit that were
+// still in use when it was exceeded. Databases in use are never closed,
+// so the limit may be exceeded for as long as more of them are in use at
+// once. Databases are closed outside of the pool's lock, and are only
+// referenced weakly, so one being dropped meanwhile is never touched.
+class HandlePool {
+ private:
+    struct Entry {
+        std::weak_ptr<Database> db;
+        // the touch it was last used by, so that one closed while it was
+        // used again is not forgotten as closed
+        uint64_t touched;
+    };
+    typedef std::list<Entry> DatabaseList;
+    typedef std::vector<std::pair<std::shared_ptr<Database>, uint64_t>>
+            CandidateList;
+
+    size_t max_open_;  // zero for no limit
+    std::chrono::milliseconds idle_timeout_;  // zero to keep idle ones open
+    DatabaseList open_;  // most recently used first
+    std::unordered_map<Database*, DatabaseList::iterator> index_;
+    uint64_t touches_;
+    uint64_t opens_;
+    uint64_t idle_closes_;
+    uint64_t evictions_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+
+    // the databases beyond the limit, least recently used first, with
+    // mutex_ held. returns how many of them are to be closed
+    size_t eviction_candidates(const Database* except,
+                               CandidateList* candidates);
+    // closes up to `limit` of the candidates unless used after `since`,
+    // without mutex_ held, counting them in `closes`
+    void close(const CandidateList& candidates,
+               std::chrono::steady_clock::time_point since,
+               size_t limit,
+               uint64_t* closes);
+    void run();
+
+ public:
+    HandlePool(size_t max_open, std::chrono::milliseconds idle_timeout);
+    ~HandlePool();
+    HandlePool(const HandlePool&) = delete;
+    HandlePool& operator=(const HandlePool&) = delete;
+    // called by a database each time it is used, `opened` if it had to
+    // be opened for that. the database must be owned by a shared_ptr
+    void touch(Database* db, bool opened);
+    // called by a database when it is closed for good
+    void forget(Database* db);
+    // closes the databases not used for longer than the idle timeout, and
+    // those beyond the limit that are not in use anymore
+    void check(std::chrono::steady_clock::time_point now);
+    HandleStats stats();
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_HANDLEPOOL_H_
@@ -0,0 +1,182 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "sqlizator/histogram.h"
+#include "sqlizator/response.h"
+
+namespace sqlizator {
+
+static const uint64_t SUB_COUNT = 1 << HISTOGRAM_SUB_BITS;
+
+Histogram::Shard::Shard(): count(0), sum(0), max(0) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        buckets[i].store(0, std::memory_order_relaxed);
+}
+
+Histogram::Histogram() {
+    for (int i = 0; i < HISTOGRAM_SHARDS; ++i)
+        shards_[i].store(NULL, std::memory_order_relaxed);
+}
+
+Histogram::~Histogram() {
+    for (int i = 0; i < HISTOGRAM_SHARDS; ++i)
+        delete shards_[i].load(std::memory_order_relaxed);
+}
+
+Histogram::Shard* Histogram::shard() {
+    // threads are assigned shards in the order they first record into any
+    // histogram, so up to HISTOGRAM_SHARDS of them never share one
+    static std::atomic<unsigned> next_index(0);
+    static thread_local unsigned index = next_index.fetch_add(1) %
+                                         HISTOGRAM_SHARDS;
+    Shard* shard = shards_[index].load(std::memory_order_acquire);
+    if (shard != NULL)
+        return shard;
+    Shard* created = new Shard();
+    if (shards_[index].compare_exchange_strong(shard,
+                                               created,
+                                               std::memory_order_acq_rel))
+        return created;
+    // another thread sharing the index was first
+    delete created;
+    return shard;
+}
+
+int Histogram::bucket(uint64_t value) {
+    // values below SUB_COUNT get a bucket of their own, above that the
+    // position of the highest set bit selects the range and the bits right
+    // after it the bucket within the range
+    if (value < SUB_COUNT)
+        return static_cast<int>(value);
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    int sub = static_cast<int>((value >> shift) & (SUB_COUNT - 1));
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+uint64_t Histogram::upper_bound(int bucket) {
+    if (bucket < static_cast<int>(SUB_COUNT))
+        return bucket;
+    int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = bucket & (SUB_COUNT - 1);
+    return (((SUB_COUNT + sub + 1) << shift) - 1);
+}
+
+void Histogram::record(uint64_t nanoseconds) {
+    Shard* own = shard();
+    own->buckets[bucket(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    own->count.fetch_add(1, std::memory_order_relaxed);
+    own->sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+    uint64_t max = own->max.load(std::memory_order_relaxed);
+    while (nanoseconds > max &&
+           !own->max.compare_exchange_weak(max,
+                                           nanoseconds,
+                                           std::memory_order_relaxed)) {}
+}
+
+void Histogram::record_since(const time_point& start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+    record(duration_cast<nanoseconds>(elapsed).count());
+}
+
+uint64_t Histogram::count() {
+    uint64_t count = 0;
+    for (int i = 0; i < HISTOGRAM_SHARDS; ++i) {
+        Shard* shard = shards_[i].load(std::memory_order_acquire);
+        if (shard != NULL)
+            count += shard->count.load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+uint64_t Histogram::mean() {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for (int i = 0; i < HISTOGRAM_SHARDS; ++i) {
+        Shard* shard = shards_[i].load(std::memory_order_acquire);
+        if (shard == NULL)
+            continue;
+        count += shard->count.load(std::memory_order_relaxed);
+        sum += shard->sum.load(std::memory_order_relaxed);
+    }
+    if (count == 0)
+        return 0;
+    return sum / count;
+}
+
+uint64_t Histogram::max() {
+    uint64_t max = 0;
+    for (int i = 0; i < HISTOGRAM_SHARDS; ++i) {
+        Shard* shard = shards_[i].load(std::memory_order_acquire);
+        if (shard != NULL)
+            max = std::max(max, shard->max.load(std::memory_order_relaxed));
+    }
+    return max;
+}
+
+uint64_t Histogram::percentile(double quantile) {
+    // buckets are read one by one while others may still record, so the
+    // result is only as consistent as a snapshot taken at that time
+    uint64_t total = 0;
+    uint64_t counts[HISTOGRAM_BUCKETS] = {};
+    for (int s = 0; s < HISTOGRAM_SHARDS; ++s) {
+        Shard* shard = shards_[s].load(std::memory_order_acquire);
+        if (shard == NULL)
+            continue;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            uint64_t count = shard->buckets[i].load(std::memory_order_relaxed);
+            counts[i] += count;
+            total += count;
+        }
+    }
+    if (total == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(quantile * total);
+    if (rank >= total)
+        rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen > rank)
+            return upper_bound(i);
+    }
+    return upper_bound(HISTOGRAM_BUCKETS - 1);
+}
+
+void Histogram::pack(Packer* packer) {
+    uint64_t max = this->max();
+    // bucket bounds may lie above the largest value actually recorded
+    double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t values[4];
+    for (int i = 0; i < 4; ++i)
+        values[i] = std::min(percentile(quantiles[i]), max);
+    packer->pack_map(7);
+    packer->pack(std::string("count"));
+    packer->pack(count());
+    packer->pack(std::string("mean_us"));
+    packer->pack(mean() / 1000);
+    packer->pack(std::string("max_us"));
+    packer->pack(max / 1000);
+    packer->pack(std::string("p50_us"));
+    packer->pack(values[0] / 1000);
+    packer->pack(std::string("p90_us"));
+    packer->pack(values[1] / 1000);
+    packer->pack(std::string("p99_us"));
+    packer->pack(values[2] / 1000);
+    packer->pack(std::string("p999_us"));
+    packer->pack(values[3] / 1000);
+}
+
+}  // namespace sqlizator
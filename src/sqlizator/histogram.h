@@ -0,0 +1,87 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_HISTOGRAM_H_
+#define SQLIZATOR_SQLIZATOR_HISTOGRAM_H_
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "sqlizator/response.h"
+
+namespace sqlizator {
+
+// every power of two range is split into 2^HISTOGRAM_SUB_BITS buckets, which
+// keeps the relative error of reported values below 1/16th
+static const int HISTOGRAM_SUB_BITS = 4;
+// values up to 2^HISTOGRAM_MAX_BITS nanoseconds (about 18 minutes) are told
+// apart, longer ones are counted in the last bucket
+static const int HISTOGRAM_MAX_BITS = 40;
+static const int HISTOGRAM_BUCKETS =
+        (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << HISTOGRAM_SUB_BITS;
+
+// threads recording into a histogram are spread over this many shards of
+// it, each allocated once a thread first records into it
+static const int HISTOGRAM_SHARDS = 8;
+
+typedef std::chrono::steady_clock::time_point time_point;
+
+// Latency histogram with log-linear buckets, in the manner of HDR
+// histograms. Recording is a few relaxed atomic increments on a shard of
+// the recording thread's own, so any number of threads may record into it
+// without locking or contending for the same counters. The shards are
+// summed up when the histogram is read.
+class Histogram {
+ private:
+    struct Shard {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+
+        Shard();
+    };
+
+    std::atomic<Shard*> shards_[HISTOGRAM_SHARDS];
+
+    static int bucket(uint64_t value);
+    static uint64_t upper_bound(int bucket);
+    // the shard of the calling thread, allocated if it has none yet
+    Shard* shard();
+
+ public:
+    Histogram();
+    ~Histogram();
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+    void record(uint64_t nanoseconds);
+    // records the time passed since `start`
+    void record_since(const time_point& start);
+    uint64_t count();
+    uint64_t mean();
+    uint64_t max();
+    // smallest bucket bound below which the `quantile` of values fall
+    uint64_t percentile(double quantile);
+    // packs count, mean, max and percentiles in microseconds as a map
+    void pack(Packer* packer);
+};
+
+// records its own lifetime into a histogram
+class Timer {
+ private:
+    Histogram* histogram_;
+    time_point start_;
+
+ public:
+    explicit Timer(Histogram* histogram):
+                                histogram_(histogram),
+                                start_(std::chrono::steady_clock::now()) {}
+    ~Timer() {
+        histogram_->record_since(start_);
+    }
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_HISTOGRAM_H_
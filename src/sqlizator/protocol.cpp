@@ -0,0 +1,285 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+#include <msgpack.hpp>
+
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sqlizator/protocol.h"
+
+namespace sqlizator {
+
+// indexed by opcode and by request key
+static const char* const OPCODE_NAMES[opcodes::COUNT] = {
+    NULL, "connect", "drop", "query", "executemany", "batch", "fetch",
+    "close", "stats", "cancel", "snapshot"};
+static const char* const KEY_NAMES[request_keys::COUNT] = {
+    "endpoint", "id", "timeout_ms", "database", "path", "query", "operation",
+    "parameters", "cursor", "batch_size", "format", "items", "transaction",
+    "request_id"};
+
+const char* opcode_name(uint8_t opcode) {
+    return opcode < opcodes::COUNT ? OPCODE_NAMES[opcode] : NULL;
+}
+
+const char* key_name(int key) {
+    if (key < 0 || key >= request_keys::COUNT)
+        return NULL;
+    return KEY_NAMES[key];
+}
+
+static bool str_equals(const msgpack::object& str, const char* text) {
+    size_t length = std::strlen(text);
+    return str.via.str.size == length &&
+           std::memcmp(str.via.str.ptr, text, length) == 0;
+}
+
+// index of the name the string is equal to, or `count` if there is none
+static int find_name(const msgpack::object& str,
+                     const char* const* names,
+                     int count) {
+    for (int i = 0; i < count; ++i) {
+        if (names[i] != NULL && str_equals(str, names[i]))
+            return i;
+    }
+    return count;
+}
+
+static int request_key(const msgpack::object& key) {
+    int found = request_keys::NONE;
+    if (key.type == msgpack::type::POSITIVE_INTEGER) {
+        if (key.via.u64 < static_cast<uint64_t>(request_keys::COUNT))
+            found = static_cast<int>(key.via.u64);
+    } else if (key.type == msgpack::type::STR) {
+        found = find_name(key, KEY_NAMES, request_keys::COUNT);
+        if (found == request_keys::COUNT)
+            found = request_keys::NONE;
+    }
+    return found;
+}
+
+static bool decode_endpoint(const msgpack::object& value,
+                            RequestFields* fields) {
+    uint8_t opcode = opcodes::COUNT;
+    if (value.type == msgpack::type::POSITIVE_INTEGER) {
+        if (value.via.u64 > 0 && value.via.u64 < opcodes::COUNT)
+            opcode = static_cast<uint8_t>(value.via.u64);
+    } else if (value.type == msgpack::type::STR) {
+        opcode = find_name(value, OPCODE_NAMES, opcodes::COUNT);
+    } else {
+        fields->endpoint_error = "Invalid endpoint name";
+        return true;
+    }
+    if (opcode == opcodes::COUNT) {
+        fields->endpoint_error = "Unknown endpoint specified";
+    } else {
+        fields->opcode = opcode;
+        fields->endpoint_error = NULL;
+    }
+    return true;
+}
+
+static bool decode_item(const msgpack::object& item, BatchItem* decoded) {
+    if (item.type != msgpack::type::MAP)
+        return false;
+    decoded->clear();
+    const msgpack::object_kv* end = item.via.map.ptr + item.via.map.size;
+    for (const msgpack::object_kv* kv = item.via.map.ptr; kv != end; ++kv) {
+        const msgpack::object& value = kv->val;
+        switch (request_key(kv->key)) {
+            case request_keys::QUERY:
+                if (value.type != msgpack::type::STR)
+                    return false;
+                decoded->query.assign(value.via.str.ptr, value.via.str.size);
+                break;
+            case request_keys::OPERATION:
+                if (value.type != msgpack::type::POSITIVE_INTEGER)
+                    return false;
+                decoded->operation = static_cast<Operation>(value.via.u64);
+                break;
+            case request_keys::PARAMETERS:
+                if (value.type != msgpack::type::ARRAY &&
+                        value.type != msgpack::type::MAP)
+                    return false;
+                decoded->parameters = value;
+                break;
+        }
+    }
+    return true;
+}
+
+// returns false if the value is not of a type the key allows
+static bool decode_field(int key,
+                         const msgpack::object& value,
+                         RequestFields* fields) {
+    switch (key) {
+        case request_keys::ENDPOINT:
+            return decode_endpoint(value, fields);
+        case request_keys::ID:
+            if (value.type != msgpack::type::POSITIVE_INTEGER)
+                return false;
+            fields->has_id = true;
+            fields->id = value.via.u64;
+            return true;
+        case request_keys::TIMEOUT_MS:
+            if (value.type != msgpack::type::POSITIVE_INTEGER)
+                return false;
+            fields->has_timeout = true;
+            fields->timeout_ms = value.via.u64;
+            return true;
+        case request_keys::DATABASE:
+            if (value.type != msgpack::type::STR)
+                return false;
+            fields->database.assign(value.via.str.ptr, value.via.str.size);
+            return true;
+        case request_keys::QUERY:
+            if (value.type != msgpack::type::STR)
+                return false;
+            fields->query.assign(value.via.str.ptr, value.via.str.size);
+            return true;
+        case request_keys::OPERATION:
+            if (value.type != msgpack::type::POSITIVE_INTEGER)
+                return false;
+            fields->operation = static_cast<Operation>(value.via.u64);
+            return true;
+        case request_keys::PARAMETERS:
+            if (value.type != msgpack::type::ARRAY &&
+                    value.type != msgpack::type::MAP)
+                return false;
+            fields->parameters = value;
+            return true;
+        case request_keys::CURSOR:
+            // whether to open one for a query, or the one to use
+            if (value.type == msgpack::type::BOOLEAN) {
+                fields->cursor = value.via.boolean;
+                return true;
+            } else if (value.type == msgpack::type::POSITIVE_INTEGER) {
+                fields->has_cursor_id = true;
+                fields->cursor_id = value.via.u64;
+                return true;
+            }
+            return false;
+        case request_keys::BATCH_SIZE:
+            if (value.type != msgpack::type::POSITIVE_INTEGER)
+                return false;
+            fields->batch_size = value.via.u64;
+            return true;
+        case request_keys::FORMAT:
+            if (value.type == msgpack::type::POSITIVE_INTEGER &&
+                    (value.via.u64 == ROWS || value.via.u64 == COLUMNAR)) {
+                fields->format = static_cast<ResultFormat>(value.via.u64);
+                return true;
+            } else if (value.type == msgpack::type::STR) {
+                if (str_equals(value, "rows"))
+                    fields->format = ROWS;
+                else if (str_equals(value, "columnar"))
+                    fields->format = COLUMNAR;
+                else
+                    return false;
+                return true;
+            }
+            return false;
+        case request_keys::ITEMS:
+            if (value.type != msgpack::type::ARRAY)
+                return false;
+            // grown only, items beyond the count keep their storage too
+            if (fields->items.size() < value.via.array.size)
+                fields->items.resize(value.via.array.size);
+            fields->item_count = value.via.array.size;
+            for (uint32_t i = 0; i < value.via.array.size; ++i) {
+                if (!decode_item(value.via.array.ptr[i], &fields->items[i]))
+                    return false;
+            }
+            return true;
+        case request_keys::TRANSACTION:
+            if (value.type != msgpack::type::STR)
+                return false;
+            if (str_equals(value, "immediate") ||
+                    str_equals(value, "IMMEDIATE"))
+                fields->immediate = true;
+            else if (str_equals(value, "deferred") ||
+                    str_equals(value, "DEFERRED"))
+                fields->immediate = false;
+            else
+                return false;
+            return true;
+        case request_keys::REQUEST_ID:
+            if (value.type != msgpack::type::POSITIVE_INTEGER)
+                return false;
+            fields->has_request_id = true;
+            fields->request_id = value.via.u64;
+            return true;
+    }
+    // the path and unknown keys are options of connect
+    return true;
+}
+
+void RequestFields::clear() {
+    opcode = opcodes::NONE;
+    endpoint_error = "Missing endpoint name";
+    invalid_key = request_keys::NONE;
+    has_id = false;
+    id = 0;
+    has_timeout = false;
+    timeout_ms = 0;
+    database.clear();
+    query.clear();
+    operation = Operation::EXECUTE;
+    parameters = msgpack::object();
+    cursor = false;
+    has_cursor_id = false;
+    cursor_id = 0;
+    batch_size = DEFAULT_BATCH_SIZE;
+    format = ResultFormat::ROWS;
+    item_count = 0;
+    immediate = false;
+    has_request_id = false;
+    request_id = 0;
+}
+
+void decode_request(const msgpack::object& request, RequestFields* fields) {
+    fields->clear();
+    if (request.type != msgpack::type::MAP) {
+        fields->endpoint_error = "Request must be a map";
+        return;
+    }
+    const msgpack::object_kv* end = request.via.map.ptr + request.via.map.size;
+    for (const msgpack::object_kv* kv = request.via.map.ptr; kv != end; ++kv) {
+        int key = request_key(kv->key);
+        if (!decode_field(key, kv->val, fields) &&
+                fields->invalid_key == request_keys::NONE)
+            fields->invalid_key = key;
+    }
+}
+
+void request_options(const msgpack::object& request,
+                     std::map<std::string, std::string>* options) {
+    if (request.type != msgpack::type::MAP)
+        throw msgpack::type_error();
+    const msgpack::object_kv* end = request.via.map.ptr + request.via.map.size;
+    for (const msgpack::object_kv* kv = request.via.map.ptr; kv != end; ++kv) {
+        int key = request_key(kv->key);
+        if (key == request_keys::ENDPOINT ||
+                key == request_keys::ID ||
+                key == request_keys::TIMEOUT_MS)
+            continue;
+        if (kv->val.type != msgpack::type::STR)
+            throw msgpack::type_error();
+        std::string value(kv->val.via.str.ptr, kv->val.via.str.size);
+        if (key != request_keys::NONE) {
+            (*options)[KEY_NAMES[key]] = value;
+        } else if (kv->key.type == msgpack::type::STR) {
+            std::string name(kv->key.via.str.ptr, kv->key.via.str.size);
+            (*options)[name] = value;
+        } else {
+            throw msgpack::type_error();
+        }
+    }
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,120 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_PROTOCOL_H_
+#define SQLIZATOR_SQLIZATOR_PROTOCOL_H_
+#include <stdint.h>
+#include <msgpack.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sqlizator/connection.h"
+#include "sqlizator/cursor.h"
+#include "sqlizator/statement.h"
+
+namespace sqlizator {
+
+// Requests are msgpack maps. Their keys are either the names of the request
+// keys below, or, to spare the server from comparing strings, their numbers.
+// Likewise the endpoint is either named or given by its opcode, and both
+// styles may be mixed within a request. Replies are the same either way.
+
+namespace opcodes {
+
+static const uint8_t NONE = 0;
+static const uint8_t CONNECT = 1;
+static const uint8_t DROP = 2;
+static const uint8_t QUERY = 3;
+static const uint8_t EXECUTEMANY = 4;
+static const uint8_t BATCH = 5;
+static const uint8_t FETCH = 6;
+static const uint8_t CLOSE = 7;
+static const uint8_t STATS = 8;
+static const uint8_t CANCEL = 9;
+static const uint8_t SNAPSHOT = 10;
+static const uint8_t COUNT = 11;
+
+}  // namespace opcodes
+
+namespace request_keys {
+
+static const int NONE = -1;
+static const int ENDPOINT = 0;
+static const int ID = 1;
+static const int TIMEOUT_MS = 2;
+static const int DATABASE = 3;
+static const int PATH = 4;
+static const int QUERY = 5;
+static const int OPERATION = 6;
+static const int PARAMETERS = 7;
+static const int CURSOR = 8;
+static const int BATCH_SIZE = 9;
+static const int FORMAT = 10;
+static const int ITEMS = 11;
+static const int TRANSACTION = 12;
+static const int REQUEST_ID = 13;
+static const int COUNT = 14;
+
+}  // namespace request_keys
+
+// name of an endpoint or of a request key, NULL for unknown ones
+const char* opcode_name(uint8_t opcode);
+const char* key_name(int key);
+
+// A request decoded in a single pass over its map, before it is queued, so
+// that scheduling, dispatch and the endpoint itself need not look up keys
+// again. Each request of the pool keeps its own, so the strings keep their
+// storage for the next request.
+struct RequestFields {
+    uint8_t opcode;
+    // why the endpoint is not known, NULL if it is
+    const char* endpoint_error;
+    // key of the first field that had a value of the wrong type, if any
+    int invalid_key;
+    bool has_id;
+    uint64_t id;
+    bool has_timeout;
+    uint64_t timeout_ms;
+    std::string database;
+    std::string query;
+    Operation operation;
+    // points into the request, which outlives the decoded fields
+    msgpack::object parameters;
+    // return only the first batch of rows and keep the rest for `fetch`
+    bool cursor;
+    // the cursor to fetch from or to close
+    bool has_cursor_id;
+    uint64_t cursor_id;
+    uint64_t batch_size;
+    ResultFormat format;
+    // items are decoded into the existing ones, so they keep their storage
+    // as well. only the first `item_count` of them belong to the request,
+    // the rest are kept around for the requests reusing these fields
+    std::vector<BatchItem> items;
+    size_t item_count;
+    // take the write lock right away instead of on the first write
+    bool immediate;
+    bool has_request_id;
+    uint64_t request_id;
+
+    RequestFields() {
+        clear();
+    }
+    // resets all fields, but the strings keep their storage
+    void clear();
+};
+
+// decodes a request, leaving what it lacks or got wrong to be reported by
+// the endpoint, so it never throws
+void decode_request(const msgpack::object& request, RequestFields* fields);
+// the fields of a request that are text, by name, for endpoints taking
+// arbitrary options. the fields handled by the dispatcher are left out,
+// other values must be strings or msgpack::type_error is thrown
+void request_options(const msgpack::object& request,
+                     std::map<std::string, std::string>* options);
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_PROTOCOL_H_
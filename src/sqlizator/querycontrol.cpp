@@ -0,0 +1,61 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "sqlizator/querycontrol.h"
+
+namespace sqlizator {
+
+thread_local QueryControl* QueryControl::current_ = NULL;
+
+QueryControl::Scope::Scope(QueryControl* control): previous_(current_) {
+    current_ = control;
+}
+
+QueryControl::Scope::~Scope() {
+    current_ = previous_;
+}
+
+QueryControl::QueryControl(): cancelled_(false), has_deadline_(false) {}
+
+void QueryControl::reset() {
+    cancelled_.store(false, std::memory_order_relaxed);
+    has_deadline_ = false;
+}
+
+void QueryControl::set_timeout(uint64_t milliseconds) {
+    has_deadline_ = true;
+    deadline_ = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(milliseconds);
+}
+
+void QueryControl::cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool QueryControl::cancelled() {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+bool QueryControl::timed_out() {
+    return has_deadline_ && std::chrono::steady_clock::now() >= deadline_;
+}
+
+QueryControl* QueryControl::current() {
+    return current_;
+}
+
+int QueryControl::progress(void* /* context */) {
+    QueryControl* control = current_;
+    if (control == NULL)
+        return 0;
+    // a non-zero result makes the statement fail with SQLITE_INTERRUPT
+    return (control->cancelled() || control->timed_out()) ? 1 : 0;
+}
+
+}  // namespace sqlizator
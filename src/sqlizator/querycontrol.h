@@ -0,0 +1,63 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_QUERYCONTROL_H_
+#define SQLIZATOR_SQLIZATOR_QUERYCONTROL_H_
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+
+namespace sqlizator {
+
+// number of sqlite virtual machine instructions between two checks whether
+// the running statement has to be stopped
+static const int PROGRESS_CHECK_INTERVAL = 1000;
+
+// Conditions under which the statements of a request are stopped: a
+// deadline, and cancellation by another thread. They are checked by the
+// progress handler of whichever connection executes the statements, which
+// runs on the executing thread, so the control of the request is made the
+// current one of that thread for as long as it executes.
+class QueryControl {
+ private:
+    std::atomic<bool> cancelled_;
+    bool has_deadline_;
+    std::chrono::steady_clock::time_point deadline_;
+
+    static thread_local QueryControl* current_;
+
+ public:
+    // makes a control the current one of this thread until it is destroyed
+    class Scope {
+     private:
+        QueryControl* previous_;
+
+     public:
+        explicit Scope(QueryControl* control);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    QueryControl();
+    QueryControl(const QueryControl&) = delete;
+    QueryControl& operator=(const QueryControl&) = delete;
+    // clears the deadline and cancellation for the next request
+    void reset();
+    // the deadline is counted from now
+    void set_timeout(uint64_t milliseconds);
+    // may be called from any thread
+    void cancel();
+    bool cancelled();
+    bool timed_out();
+    // control of the request executed by the calling thread, if any
+    static QueryControl* current();
+    // sqlite progress handler, which interrupts the statement being
+    // stepped once the current control says so
+    static int progress(void* context);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_QUERYCONTROL_H_
@@ -0,0 +1,218 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <time.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "sqlizator/querylog.h"
+
+namespace sqlizator {
+
+FILE* open_log(const std::string& path) {
+    if (path == "-")
+        return stdout;
+    FILE* file = std::fopen(path.c_str(), "a");
+    if (file == NULL) {
+        std::string msg(std::strerror(errno));
+        throw std::runtime_error(path + ": " + msg);
+    }
+    return file;
+}
+
+void close_log(FILE* file) {
+    if (file != NULL && file != stdout)
+        std::fclose(file);
+}
+
+void write_json_string(FILE* file, const std::string& str) {
+    std::fputc('"', file);
+    for (auto it = str.begin(); it != str.end(); ++it) {
+        unsigned char c = *it;
+        if (c == '"' || c == '\\') {
+            std::fputc('\\', file);
+            std::fputc(c, file);
+        } else if (c == '\n') {
+            std::fputs("\\n", file);
+        } else if (c < 0x20) {
+            std::fprintf(file, "\\u%04x", c);
+        } else {
+            std::fputc(c, file);
+        }
+    }
+    std::fputc('"', file);
+}
+
+QueryLog::QueryLog(const std::string& path,
+                   const std::string& slow_path,
+                   uint64_t slow_threshold_ms):
+                                path_(path),
+                                slow_path_(slow_path),
+                                slow_threshold_ns_(slow_threshold_ms * 1000000),
+                                slots_(new Slot[QUERY_LOG_CAPACITY]),
+                                mask_(QUERY_LOG_CAPACITY - 1),
+                                write_pos_(0),
+                                read_pos_(0),
+                                dropped_(0),
+                                running_(false),
+                                file_(NULL),
+                                slow_file_(NULL) {
+    for (size_t i = 0; i < QUERY_LOG_CAPACITY; ++i)
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+QueryLog::~QueryLog() {
+    stop();
+}
+
+bool QueryLog::enabled() {
+    return !path_.empty() || !slow_path_.empty();
+}
+
+void QueryLog::start() {
+    if (!enabled() || running_)
+        return;
+    if (!path_.empty())
+        file_ = open_log(path_);
+    if (!slow_path_.empty())
+        slow_file_ = (slow_path_ == path_) ? file_ : open_log(slow_path_);
+    running_ = true;
+    writer_ = std::thread(&QueryLog::run, this);
+}
+
+void QueryLog::stop() {
+    if (!running_)
+        return;
+    running_ = false;
+    writer_.join();
+    if (slow_file_ != file_)
+        close_log(slow_file_);
+    close_log(file_);
+    file_ = slow_file_ = NULL;
+}
+
+void QueryLog::record(const std::string& database,
+                      const char* sql,
+                      uint64_t duration_ns,
+                      uint64_t rows,
+                      uint64_t bytes) {
+    bool slow = !slow_path_.empty() && duration_ns >= slow_threshold_ns_;
+    if (path_.empty() && !slow)
+        return;
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    LogEntry entry;
+    entry.slow = false;
+    entry.time = duration_cast<microseconds>(now).count();
+    entry.duration_ns = duration_ns;
+    entry.rows = rows;
+    entry.bytes = bytes;
+    entry.database = database;
+    entry.sql = (sql != NULL) ? sql : "";
+    if (slow && !path_.empty()) {
+        LogEntry copy(entry);
+        copy.slow = true;
+        push(&copy);
+    } else if (slow) {
+        entry.slow = true;
+    }
+    push(&entry);
+}
+
+uint64_t QueryLog::dropped() {
+    return dropped_;
+}
+
+void QueryLog::push(LogEntry* entry) {
+    // bounded multi-producer queue: a slot may be written once its sequence
+    // equals the claimed position, and is published by advancing it by one
+    size_t pos = write_pos_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots_[pos & mask_];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (write_pos_.compare_exchange_weak(pos,
+                                                 pos + 1,
+                                                 std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            // the writer thread is behind by a full ring
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = write_pos_.load(std::memory_order_relaxed);
+        }
+    }
+    slot->entry = std::move(*entry);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+bool QueryLog::pop(LogEntry* entry) {
+    // only the writer thread consumes, so the read position needs no atomics
+    Slot* slot = &slots_[read_pos_ & mask_];
+    if (slot->sequence.load(std::memory_order_acquire) != read_pos_ + 1)
+        return false;
+    *entry = std::move(slot->entry);
+    slot->sequence.store(read_pos_ + mask_ + 1, std::memory_order_release);
+    ++read_pos_;
+    return true;
+}
+
+void QueryLog::run() {
+    LogEntry entry;
+    while (true) {
+        bool stopping = !running_;
+        size_t written = 0;
+        while (pop(&entry)) {
+            write(entry.slow ? slow_file_ : file_, entry);
+            ++written;
+        }
+        if (written > 0) {
+            if (file_ != NULL)
+                std::fflush(file_);
+            if (slow_file_ != NULL && slow_file_ != file_)
+                std::fflush(slow_file_);
+        }
+        // entries pushed before stop was called are written out as well
+        if (stopping)
+            break;
+        if (written == 0) {
+            auto pause = std::chrono::milliseconds(QUERY_LOG_POLL_MS);
+            std::this_thread::sleep_for(pause);
+        }
+    }
+}
+
+void QueryLog::write(FILE* file, const LogEntry& entry) {
+    time_t seconds = entry.time / 1000000;
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    std::fprintf(file,
+                 "{\"time\":\"%s.%06uZ\",\"type\":\"%s\",\"database\":",
+                 stamp,
+                 static_cast<unsigned>(entry.time % 1000000),
+                 entry.slow ? "slow" : "query");
+    write_json_string(file, entry.database);
+    std::fprintf(file,
+                 ",\"duration_us\":%llu,\"rows\":%llu,\"bytes\":%llu,\"sql\":",
+                 static_cast<unsigned long long>(entry.duration_ns / 1000),
+                 static_cast<unsigned long long>(entry.rows),
+                 static_cast<unsigned long long>(entry.bytes));
+    write_json_string(file, entry.sql);
+    std::fputs("}\n", file);
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,83 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_QUERYLOG_H_
+#define SQLIZATOR_SQLIZATOR_QUERYLOG_H_
+#include <stdint.h>
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace sqlizator {
+
+// number of entries the ring buffer holds, must be a power of two. entries
+// recorded while it is full are dropped instead of blocking the query
+static const size_t QUERY_LOG_CAPACITY = 8192;
+static const uint64_t DEFAULT_SLOW_QUERY_MS = 100;
+// how long the writer thread sleeps when there is nothing to write
+static const int QUERY_LOG_POLL_MS = 50;
+
+struct LogEntry {
+    bool slow;
+    // microseconds since the epoch when the statement finished
+    uint64_t time;
+    uint64_t duration_ns;
+    uint64_t rows;
+    uint64_t bytes;
+    std::string database;
+    std::string sql;
+};
+
+// Writes executed statements as JSON lines, either all of them, only the
+// ones slower than a threshold, or both into separate files. Entries are
+// passed from the query threads to a background writer thread through a
+// lock-free ring buffer, so recording never waits on the disk.
+class QueryLog {
+ private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        LogEntry entry;
+    };
+
+    std::string path_;
+    std::string slow_path_;
+    uint64_t slow_threshold_ns_;
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    std::atomic<size_t> write_pos_;
+    size_t read_pos_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<bool> running_;
+    std::thread writer_;
+    FILE* file_;
+    FILE* slow_file_;
+
+    void push(LogEntry* entry);
+    bool pop(LogEntry* entry);
+    void run();
+    void write(FILE* file, const LogEntry& entry);
+
+ public:
+    // an empty path disables the respective log, "-" writes to stdout
+    QueryLog(const std::string& path,
+             const std::string& slow_path,
+             uint64_t slow_threshold_ms = DEFAULT_SLOW_QUERY_MS);
+    ~QueryLog();
+    bool enabled();
+    void start();
+    void stop();
+    // called by sqlite for every completed statement, from any thread
+    void record(const std::string& database,
+                const char* sql,
+                uint64_t duration_ns,
+                uint64_t rows,
+                uint64_t bytes);
+    uint64_t dropped();
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_QUERYLOG_H_
@@ -0,0 +1,48 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <mutex>
+#include <vector>
+
+#include "sqlizator/requestpool.h"
+
+namespace sqlizator {
+
+RequestPool::~RequestPool() {
+    for (auto it = idle_.begin(); it != idle_.end(); ++it)
+        delete *it;
+}
+
+Request* RequestPool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!idle_.empty()) {
+            Request* request = idle_.back();
+            idle_.pop_back();
+            return request;
+        }
+    }
+    return new Request();
+}
+
+void RequestPool::release(Request* request) {
+    // the zone keeps its first chunk and the reply buffers their capacity
+    request->zone.clear();
+    request->object = msgpack::object();
+    request->input.reset();
+    request->reply.clear();
+    request->control.reset();
+    request->tracked = false;
+    request->cancelled = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < MAX_POOLED_REQUESTS) {
+            idle_.push_back(request);
+            return;
+        }
+    }
+    delete request;
+}
+
+}  // namespace sqlizator
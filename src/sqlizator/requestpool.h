@@ -0,0 +1,62 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_REQUESTPOOL_H_
+#define SQLIZATOR_SQLIZATOR_REQUESTPOOL_H_
+#include <msgpack.hpp>
+
+#include <mutex>
+#include <vector>
+
+#include "sqlizator/protocol.h"
+#include "sqlizator/querycontrol.h"
+#include "sqlizator/response.h"
+#include "tcpserver/commontypes.h"
+
+namespace sqlizator {
+
+// idle requests kept for reuse, any released beyond that are freed
+static const size_t MAX_POOLED_REQUESTS = 128;
+
+// a request decoded from the receive buffer, along with the buffers its
+// reply is packed into
+struct Request {
+    // holds the decoded objects, strings and blobs stay in `input`
+    msgpack::zone zone;
+    msgpack::object object;
+    tcpserver::shared_byte_vec input;
+    RequestFields fields;
+    Reply reply;
+    QueryControl control;
+    // the client connection it came from, see ClientState
+    uint64_t client;
+    // whether it can be cancelled by the id its client gave it
+    bool tracked;
+    // requests stopped by a cancel request, which does so as it is decoded
+    uint64_t cancelled;
+
+    Request(): client(0), tracked(false), cancelled(0) {}
+};
+
+// Recycles requests, so that the unpacker zone and the reply buffers keep
+// the memory they grew to for the next request instead of being allocated
+// anew each time. Shared by all connections, so that a connection going
+// idle leaves its requests to the others.
+class RequestPool {
+ private:
+    std::mutex mutex_;
+    std::vector<Request*> idle_;
+
+ public:
+    RequestPool() {}
+    ~RequestPool();
+    RequestPool(const RequestPool&) = delete;
+    RequestPool& operator=(const RequestPool&) = delete;
+    Request* acquire();
+    // clears the request and takes it back
+    void release(Request* request);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_REQUESTPOOL_H_
@@ -0,0 +1,171 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <vector>
+
+#include "sqlizator/requestscanner.h"
+#include "tcpserver/exceptions.h"
+
+namespace sqlizator {
+
+namespace {
+
+uint64_t read_big_endian(const uint8_t* data, uint64_t size) {
+    uint64_t value = 0;
+    for (uint64_t i = 0; i < size; ++i)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+}  // namespace
+
+RequestScanner::RequestScanner(): offset_(0), complete_(false) {}
+
+void RequestScanner::finish_element() {
+    // a finished container is an element of the one enclosing it
+    while (!remaining_.empty()) {
+        if (--remaining_.back() > 0)
+            return;
+        remaining_.pop_back();
+    }
+    complete_ = true;
+}
+
+uint64_t RequestScanner::scan(const uint8_t* data,
+                              uint64_t size,
+                              uint64_t limit) {
+    while (!complete_) {
+        if (offset_ >= size)
+            return 0;
+        uint8_t type = data[offset_];
+        // bytes of the length or element count following the type byte
+        uint64_t field = 0;
+        // fixed part of the body, the length is added to it
+        uint64_t body = 0;
+        // elements per count of a container, zero for other types
+        uint64_t per_count = 0;
+        uint64_t elements = 0;
+        if (type <= 0x7f || type >= 0xe0) {
+            // positive and negative fixint
+        } else if (type <= 0x8f) {
+            elements = (type & 0x0f) * 2;
+        } else if (type <= 0x9f) {
+            elements = type & 0x0f;
+        } else if (type <= 0xbf) {
+            body = type & 0x1f;
+        } else {
+            switch (type) {
+                case 0xc0:  // nil
+                case 0xc2:  // false
+                case 0xc3:  // true
+                    break;
+                case 0xc4:  // bin 8
+                case 0xd9:  // str 8
+                    field = 1;
+                    break;
+                case 0xc5:  // bin 16
+                case 0xda:  // str 16
+                    field = 2;
+                    break;
+                case 0xc6:  // bin 32
+                case 0xdb:  // str 32
+                    field = 4;
+                    break;
+                case 0xc7:  // ext 8, 16 and 32 with their type byte
+                    field = 1;
+                    body = 1;
+                    break;
+                case 0xc8:
+                    field = 2;
+                    body = 1;
+                    break;
+                case 0xc9:
+                    field = 4;
+                    body = 1;
+                    break;
+                case 0xcc:  // uint 8
+                case 0xd0:  // int 8
+                    body = 1;
+                    break;
+                case 0xcd:
+                case 0xd1:
+                    body = 2;
+                    break;
+                case 0xca:  // float 32
+                case 0xce:
+                case 0xd2:
+                    body = 4;
+                    break;
+                case 0xcb:  // float 64
+                case 0xcf:
+                case 0xd3:
+                    body = 8;
+                    break;
+                case 0xd4:  // fixext 1, 2, 4, 8 and 16 with their type byte
+                    body = 2;
+                    break;
+                case 0xd5:
+                    body = 3;
+                    break;
+                case 0xd6:
+                    body = 5;
+                    break;
+                case 0xd7:
+                    body = 9;
+                    break;
+                case 0xd8:
+                    body = 17;
+                    break;
+                case 0xdc:  // array 16
+                    field = 2;
+                    per_count = 1;
+                    break;
+                case 0xdd:  // array 32
+                    field = 4;
+                    per_count = 1;
+                    break;
+                case 0xde:  // map 16
+                    field = 2;
+                    per_count = 2;
+                    break;
+                case 0xdf:  // map 32
+                    field = 4;
+                    per_count = 2;
+                    break;
+                default:
+                    throw tcpserver::protocol_error("Invalid type in request.");
+            }
+        }
+        // the header is looked at again once all of it was received
+        if (offset_ + 1 + field > size)
+            return 0;
+        uint64_t value = read_big_endian(data + offset_ + 1, field);
+        if (per_count)
+            elements = value * per_count;
+        else
+            body += value;
+        offset_ += 1 + field + body;
+        // every element takes at least one byte
+        if (offset_ + elements > limit)
+            throw tcpserver::protocol_error("Request too large.");
+        if (elements > 0) {
+            if (remaining_.size() == MAX_REQUEST_DEPTH)
+                throw tcpserver::protocol_error("Request nested too deep.");
+            remaining_.push_back(elements);
+        } else {
+            finish_element();
+        }
+    }
+    // the body of the last element may still be arriving
+    if (offset_ > size)
+        return 0;
+    uint64_t length = offset_;
+    offset_ = 0;
+    complete_ = false;
+    return length;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,43 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_REQUESTSCANNER_H_
+#define SQLIZATOR_SQLIZATOR_REQUESTSCANNER_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace sqlizator {
+
+// containers nested deeper than this are rejected, the same depth the
+// msgpack unpacker itself has room for
+static const size_t MAX_REQUEST_DEPTH = 32;
+
+// Finds where the msgpack object at the start of the input ends, without
+// decoding it. The input may arrive in any number of parts, and what was
+// scanned already is not looked at again, so that a request is unpacked
+// only once all of it was received, and in a single pass.
+class RequestScanner {
+ private:
+    // offset of the next element header, which may be past the received
+    // data while the body of a string or blob is still arriving
+    uint64_t offset_;
+    // elements left in each of the containers the offset is nested in
+    std::vector<uint64_t> remaining_;
+    bool complete_;
+
+    void finish_element();
+
+ public:
+    RequestScanner();
+    // returns the size of the object at the start of `data` once all of it
+    // is available, zero while more is needed. `data` must begin with the
+    // bytes passed in before, until the object was found complete. objects
+    // longer than `limit` are rejected with a protocol_error
+    uint64_t scan(const uint8_t* data, uint64_t size, uint64_t limit);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_REQUESTSCANNER_H_
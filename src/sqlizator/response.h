@@ -6,21 +6,95 @@
 #define SQLIZATOR_SQLIZATOR_ERROR_CODES_H_
 #include <msgpack.hpp>
 
+#include <cstddef>
 #include <stdexcept>
 #include <string>
 
 namespace sqlizator {
 
-typedef msgpack::packer<msgpack::sbuffer> Packer;
+// packer which keeps its buffer at hand, so that already serialized objects
+// can be appended to it directly
+class Packer: public msgpack::packer<msgpack::sbuffer> {
+ private:
+    msgpack::sbuffer* buffer_;
+
+ public:
+    explicit Packer(msgpack::sbuffer* buffer):
+                                    msgpack::packer<msgpack::sbuffer>(buffer),
+                                    buffer_(buffer) {}
+    msgpack::sbuffer* buffer() { return buffer_; }
+};
+
+// serialized reply to a single request: a header map followed by the
+// optional row data, which are packed into separate buffers
+struct Reply {
+    msgpack::sbuffer header_buf;
+    msgpack::sbuffer data_buf;
+    Packer header;
+    Packer data;
+
+    Reply(): header(&header_buf), data(&data_buf) {}
+    // discard everything packed so far, so that a request failing midway
+    // does not leave a partial reply in the stream
+    void clear() {
+        header_buf.clear();
+        data_buf.clear();
+    }
+};
 
 namespace header_sizes {
 
+static const int STATUS = 3;
 static const int CONNECT = 3;
 static const int DROP = 3;
 static const int QUERY = 5;
+static const int CURSOR_QUERY = 6;
+static const int EXECUTEMANY = 5;
+static const int BATCH = 5;
+static const int BATCH_ITEM = 2;
+static const int FETCH = 5;
+static const int CLOSE = 3;
+static const int STATS = 8;
+static const int CANCEL = 4;
+static const int SNAPSHOT = 3;
 
 }  // namespace header_sizes
 
+// keys of reply headers, serialized ahead of time as msgpack fixstr objects
+// (0xa0 | length, then the key itself) so packing one is a single append
+namespace header_keys {
+
+static const char STATUS[] = "\xa6" "status";
+static const char MESSAGE[] = "\xa7" "message";
+static const char DETAILS[] = "\xa7" "details";
+static const char COLUMNS[] = "\xa7" "columns";
+static const char ROWCOUNT[] = "\xa8" "rowcount";
+static const char CURSOR[] = "\xa6" "cursor";
+static const char FAILED[] = "\xa6" "failed";
+static const char RESULTS[] = "\xa7" "results";
+static const char CANCELLED[] = "\xa9" "cancelled";
+
+}  // namespace header_keys
+
+// value types of columnar results, as fixstr objects like the header keys
+namespace column_types {
+
+static const char INT64[] = "\xa5" "int64";
+static const char FLOAT64[] = "\xa7" "float64";
+static const char ANY[] = "\xa3" "any";
+
+}  // namespace column_types
+
+// appends already serialized objects
+inline void pack_raw(Packer* packer, const char* data, size_t size) {
+    packer->buffer()->write(data, size);
+}
+
+template<size_t N>
+inline void pack_key(Packer* packer, const char (&key)[N]) {
+    pack_raw(packer, key, N - 1);
+}
+
 namespace status_codes {
 
 static const int OK = 0;
@@ -30,6 +104,9 @@ static const int DESERIALIZATION_ERROR = 3;
 static const int DATABASE_OPENING_ERROR = 4;
 static const int DATABASE_NOT_FOUND = 5;
 static const int INVALID_QUERY = 6;
+static const int CURSOR_NOT_FOUND = 7;
+static const int QUERY_TIMEOUT = 8;
+static const int QUERY_CANCELLED = 9;
 
 }  // namespace status_codes
 
@@ -0,0 +1,127 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <msgpack.hpp>
+
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "sqlizator/response.h"
+#include "sqlizator/resultcache.h"
+
+namespace sqlizator {
+
+// bookkeeping of an entry besides its strings
+static const size_t ENTRY_OVERHEAD = 128;
+
+ResultCache::ResultCache(size_t capacity): capacity_(capacity),
+                                           size_(0),
+                                           generation_(0),
+                                           hits_(0),
+                                           misses_(0),
+                                           evictions_(0) {}
+
+size_t ResultCache::cost(size_t key_size,
+                         size_t header_size,
+                         size_t data_size) {
+    // the key is stored twice, in the entry and in the index
+    return 2 * key_size + header_size + data_size + ENTRY_OVERHEAD;
+}
+
+size_t ResultCache::cost(const Entry& entry) {
+    return cost(entry.key.size(), entry.header.size(), entry.data.size());
+}
+
+bool ResultCache::enabled() {
+    return capacity_ > 0;
+}
+
+bool ResultCache::lookup(const std::string& key, Packer* header, Packer* data) {
+    std::shared_ptr<Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = index_.find(key);
+        if (found == index_.end()) {
+            misses_ += 1;
+            return false;
+        }
+        hits_ += 1;
+        entries_.splice(entries_.begin(), entries_, found->second);
+        entry = *found->second;
+    }
+    // the entry stays intact even if it is evicted meanwhile, so large
+    // results are copied without holding up other lookups
+    pack_raw(header, entry->header.data(), entry->header.size());
+    pack_raw(data, entry->data.data(), entry->data.size());
+    return true;
+}
+
+uint64_t ResultCache::generation() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return generation_;
+}
+
+void ResultCache::store(const std::string& key,
+                        uint64_t generation,
+                        const msgpack::sbuffer& header,
+                        const msgpack::sbuffer& data) {
+    // checked before copying anything, results too big to be cached are
+    // common enough with a small budget
+    size_t entry_cost = cost(key.size(), header.size(), data.size());
+    if (entry_cost > capacity_ / RESULT_CACHE_MAX_ENTRY_SHARE)
+        return;
+    std::shared_ptr<Entry> entry(new Entry());
+    entry->key = key;
+    entry->header.assign(header.data(), header.size());
+    entry->data.assign(data.data(), data.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (generation != generation_)
+        return;  // the database changed while the result was computed
+    auto found = index_.find(key);
+    if (found != index_.end()) {
+        // another thread computed the same result in parallel
+        size_ -= cost(**found->second);
+        entries_.erase(found->second);
+        index_.erase(found);
+    }
+    entries_.push_front(std::move(entry));
+    index_.insert(std::make_pair(key, entries_.begin()));
+    size_ += entry_cost;
+    while (size_ > capacity_) {
+        EntryList::iterator last = std::prev(entries_.end());
+        size_ -= cost(**last);
+        index_.erase((*last)->key);
+        entries_.erase(last);
+        evictions_ += 1;
+    }
+}
+
+void ResultCache::invalidate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    generation_ += 1;
+    if (entries_.empty())
+        return;
+    index_.clear();
+    entries_.clear();
+    size_ = 0;
+}
+
+ResultCacheStats ResultCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ResultCacheStats stats;
+    stats.size = size_;
+    stats.capacity = capacity_;
+    stats.entries = entries_.size();
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.evictions = evictions_;
+    stats.invalidations = generation_;
+    return stats;
+}
+
+}  // namespace sqlizator
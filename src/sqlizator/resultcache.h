@@ -0,0 +1,79 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_RESULTCACHE_H_
+#define SQLIZATOR_SQLIZATOR_RESULTCACHE_H_
+#include <stdint.h>
+
+#include <msgpack.hpp>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "sqlizator/response.h"
+
+namespace sqlizator {
+
+// results bigger than this share of the budget are not cached, so a single
+// one cannot flush everything else out
+static const size_t RESULT_CACHE_MAX_ENTRY_SHARE = 4;
+
+struct ResultCacheStats {
+    uint64_t size;  // bytes held by the cached results
+    uint64_t capacity;
+    uint64_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+};
+
+// Bounded LRU cache of encoded query results, keyed by whatever identifies
+// a query and its parameters. Any write to the database drops all of it.
+// Results computed while a write was going on may already be outdated, so
+// they are stored only if no invalidation happened since their query began.
+class ResultCache {
+ private:
+    struct Entry {
+        std::string key;
+        std::string header;
+        std::string data;
+    };
+    typedef std::list<std::shared_ptr<Entry>> EntryList;
+    typedef std::unordered_map<std::string, EntryList::iterator> EntryIndex;
+
+    size_t capacity_;
+    size_t size_;
+    EntryList entries_;  // most recently used first
+    EntryIndex index_;
+    uint64_t generation_;  // number of invalidations so far
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+    std::mutex mutex_;
+
+    static size_t cost(size_t key_size, size_t header_size, size_t data_size);
+    static size_t cost(const Entry& entry);
+ public:
+    explicit ResultCache(size_t capacity);
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+    bool enabled();
+    // packs the cached result of `key` verbatim, false if there is none
+    bool lookup(const std::string& key, Packer* header, Packer* data);
+    // to be passed to `store` once the result is known
+    uint64_t generation();
+    void store(const std::string& key,
+               uint64_t generation,
+               const msgpack::sbuffer& header,
+               const msgpack::sbuffer& data);
+    void invalidate();
+    ResultCacheStats stats();
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_RESULTCACHE_H_
@@ -2,51 +2,108 @@
 // Some rights reserved.
 // This software is free software licensed under the terms of GPLv3. See COPYING
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <sqlite3.h>
 #include <msgpack.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "sqlizator/cursor.h"
 #include "sqlizator/database.h"
 #include "sqlizator/exceptions.h"
+#include "sqlizator/querycontrol.h"
 #include "sqlizator/response.h"
 #include "sqlizator/server.h"
+#include "sqlizator/tuning.h"
+#include "tcpserver/exceptions.h"
+#include "tcpserver/heapcounter.h"
 
 namespace sqlizator {
 
-DBServer::DBServer(const std::string& port): tcpserver::Server(port) {
-    endpoints_.insert(std::make_pair("connect", &DBServer::endpoint_connect));
-    endpoints_.insert(std::make_pair("drop", &DBServer::endpoint_drop));
-    endpoints_.insert(std::make_pair("query", &DBServer::endpoint_query));
+DBServer::DBServer(const std::string& port,
+                   const std::string& unix_path,
+                   size_t workers,
+                   size_t reactors,
+                   QueryLog* query_log,
+                   size_t max_open_databases,
+                   uint64_t idle_timeout_ms):
+                        tcpserver::Server(port, unix_path, workers, reactors),
+                        handles_(max_open_databases,
+                                 std::chrono::milliseconds(idle_timeout_ms)),
+                        databases_(std::make_shared<DBContainer>()),
+                        next_cursor_id_(1),
+                        query_log_(query_log),
+                        next_client_id_(1) {
+    add_endpoint(opcodes::CONNECT, &DBServer::endpoint_connect);
+    add_endpoint(opcodes::DROP, &DBServer::endpoint_drop);
+    add_endpoint(opcodes::QUERY, &DBServer::endpoint_query);
+    add_endpoint(opcodes::EXECUTEMANY, &DBServer::endpoint_executemany);
+    add_endpoint(opcodes::BATCH, &DBServer::endpoint_batch);
+    add_endpoint(opcodes::FETCH, &DBServer::endpoint_fetch);
+    add_endpoint(opcodes::CLOSE, &DBServer::endpoint_close);
+    add_endpoint(opcodes::STATS, &DBServer::endpoint_stats);
+    add_endpoint(opcodes::CANCEL, &DBServer::endpoint_cancel);
+    add_endpoint(opcodes::SNAPSHOT, &DBServer::endpoint_snapshot);
+}
+
+void DBServer::add_endpoint(uint8_t opcode, endpoint_fn fn) {
+    Endpoint& endpoint = endpoints_[opcode];
+    endpoint.fn = fn;
+    endpoint.latency.reset(new Histogram());
 }
 
 void DBServer::set_status(int status,
                           const std::string& message,
                           const std::string& extended,
                           Packer* reply_header) {
-    reply_header->pack(std::string("status"));
+    pack_key(reply_header, header_keys::STATUS);
     reply_header->pack(status);
-    reply_header->pack(std::string("message"));
+    pack_key(reply_header, header_keys::MESSAGE);
     reply_header->pack(message);
-    reply_header->pack(std::string("details"));
+    pack_key(reply_header, header_keys::DETAILS);
     reply_header->pack(extended);
 }
 
-void DBServer::endpoint_connect(const msgpack::object& request,
-                                Packer* reply_header,
-                                Packer* reply_data) {
-    reply_header->pack_map(header_sizes::CONNECT);
+void DBServer::set_query_error(sqlite_error& e, Packer* reply_header) {
+    QueryControl* control = QueryControl::current();
+    if (dynamic_cast<query_interrupted*>(&e) != NULL && control != NULL) {
+        // the request may have been cancelled after its deadline passed
+        if (control->cancelled())
+            set_status(status_codes::QUERY_CANCELLED,
+                       "Query cancelled.",
+                       e.extended(),
+                       reply_header);
+        else
+            set_status(status_codes::QUERY_TIMEOUT,
+                       "Query timed out.",
+                       e.extended(),
+                       reply_header);
+        return;
+    }
+    set_status(status_codes::INVALID_QUERY, e.what(), e.extended(), reply_header);
+}
+
+void DBServer::endpoint_connect(const Request& request,
+                                Reply* reply) {
+    reply->header.pack_map(header_sizes::CONNECT);
     std::map<std::string, std::string> msg;
     try {
-        request.convert(msg);
+        request_options(request.object, &msg);
     } catch (msgpack::type_error& e) {
         // TODO: log error, message cannot be deserialized
         set_status(status_codes::DESERIALIZATION_ERROR,
                    "Deserialization failed.",
                    e.what(),
-                   reply_header);
+                   &reply->header);
         return;
     }
     std::string name;
@@ -58,60 +115,159 @@ void DBServer::endpoint_connect(const msgpack::object& request,
         set_status(status_codes::INVALID_REQUEST,
                    "Missing database name or path.",
                    "",
-                   reply_header);
+                   &reply->header);
         return;
     }
     // check if it's already connected to the database maybe
-    if (!databases_.count(name)) {
+    std::shared_ptr<Database> existing = find_database(name);
+    if (!existing) {
         // no connection exists yet
-        std::shared_ptr<Database> db(new Database(path));
+        size_t cache_size = DEFAULT_STATEMENT_CACHE_SIZE;
+        size_t reader_count = DEFAULT_READER_COUNT;
+        size_t result_cache_size = 0;
+        size_t group_size = 0;
+        uint64_t group_window = 0;
+        uint32_t weight = 1;
+        PragmaList pragmas;
+        // ":memory:" is an in-memory database of its own, like in sqlite
+        bool memory = (path == ":memory:");
+        std::string snapshot_path;
+        uint64_t snapshot_interval = 0;
+        try {
+            if (msg.count("statement_cache_size"))
+                cache_size = std::stoul(msg["statement_cache_size"]);
+            // bytes of read-only query results to keep, zero for none.
+            // results of statements that call random() or the date and
+            // time functions are never kept, see Statement::deterministic
+            if (msg.count("result_cache_size"))
+                result_cache_size = std::stoul(msg["result_cache_size"]);
+            if (msg.count("readers"))
+                reader_count = std::stoul(msg["readers"]);
+            if (msg.count("group_commit_size"))
+                group_size = std::stoul(msg["group_commit_size"]);
+            if (msg.count("group_commit_window"))
+                group_window = std::stoull(msg["group_commit_window"]);
+            if (msg.count("weight"))
+                weight = std::stoul(msg["weight"]);
+            if (msg.count("mode") && msg["mode"] == "memory")
+                memory = true;
+            else if (msg.count("mode") && msg["mode"] != "file")
+                throw std::invalid_argument("Unknown mode " + msg["mode"] + ".");
+            // an in-memory database is saved to the file at its path, unless
+            // it is given another one
+            if (memory && path != ":memory:")
+                snapshot_path = path;
+            if (msg.count("snapshot")) {
+                if (!memory)
+                    throw std::invalid_argument(
+                            "Only in-memory databases take snapshots.");
+                snapshot_path = msg["snapshot"];
+            }
+            if (msg.count("snapshot_interval"))
+                snapshot_interval = std::stoull(msg["snapshot_interval"]);
+            // a profile sets a group of pragmas at once, any of which may
+            // still be overridden one by one
+            if (msg.count("profile") &&
+                    !tuning_profile(msg["profile"], &pragmas))
+                throw std::invalid_argument("Unknown profile " +
+                                            msg["profile"] + ".");
+            for (auto it = msg.begin(); it != msg.end(); ++it) {
+                if (tunable(it->first))
+                    set_pragma(&pragmas,
+                               it->first,
+                               checked_pragma(it->first, it->second));
+            }
+        } catch (std::logic_error& e) {
+            set_status(status_codes::INVALID_REQUEST,
+                       "Invalid option value.",
+                       e.what(),
+                       &reply->header);
+            return;
+        }
+        std::shared_ptr<Database> db(new Database(path,
+                                                  cache_size,
+                                                  query_log_,
+                                                  result_cache_size,
+                                                  &handles_));
+        db->group_commit(group_size, std::chrono::microseconds(group_window));
+        if (memory)
+            db->keep_in_memory(snapshot_path,
+                               std::chrono::seconds(snapshot_interval));
+        // applied in order once the database is opened, by the writer and
+        // by every reader
+        for (auto it = pragmas.begin(); it != pragmas.end(); ++it)
+            db->pragma(it->first, it->second);
+        // in WAL mode, queries that only read get their own connections.
+        // the database is closed on failure right away, instead of staying
+        // in the pool of open ones until it is destroyed
         try {
             db->connect();
+            db->open_readers(reader_count);
         } catch (sqlite_error& e) {
+            db->close();
             set_status(status_codes::DATABASE_OPENING_ERROR,
                        e.what(),
                        e.extended(),
-                       reply_header);
+                       &reply->header);
             return;
         }
-        // apply passed in pragmas to newly opened database
-        for (auto it = msg.begin(); it != msg.end(); ++it) {
-            if (std::find(std::begin(PRAGMAS),
-                          std::end(PRAGMAS),
-                          it->first) != std::end(PRAGMAS))
-                db->pragma(it->first, it->second);
+        // opened, and loaded from its snapshot, before taking the lock, as
+        // that may take long, and only added if the name is still free
+        {
+            std::lock_guard<std::mutex> lock(databases_mutex_);
+            std::shared_ptr<const DBContainer> databases(all_databases());
+            auto found = databases->find(name);
+            if (found != databases->end()) {
+                existing = found->second;
+            } else {
+                // its requests are queued apart from those of other
+                // databases, and its writes only run as many at a time as
+                // can be grouped, so that the workers are not all left
+                // waiting for its writer
+                db->set_flow(workers()->add_flow(
+                                        weight,
+                                        std::max<size_t>(group_size, 1)));
+                if (!snapshot_path.empty() && snapshot_interval > 0)
+                    snapshots_.add(db);
+                std::shared_ptr<DBContainer> changed(
+                                            new DBContainer(*databases));
+                changed->insert(std::make_pair(name, std::move(db)));
+                std::atomic_store(&databases_,
+                                  std::shared_ptr<const DBContainer>(changed));
+            }
         }
-        databases_.insert(std::make_pair(name, std::move(db)));
-    } else {
+        // connected by another request meanwhile, whose database is used
+        if (existing)
+            db->close();
+    }
+    if (existing) {
         // already connected to a database with that name
-        std::shared_ptr<Database> db = databases_.at(name);
         // in case the database was already open, verify that the passed in path
         // matches the path of the already open database. in case it doesn't, the
         // same name was used for two different databases, which is unacceptable
-        if (db->path() != path) {
+        if (existing->path() != path) {
             set_status(status_codes::INVALID_REQUEST,
                        "Database name already in use under different path.",
-                       db->path(),
-                       reply_header);
+                       existing->path(),
+                       &reply->header);
             return;
         }
     }
-    set_status(status_codes::OK, response_messages::OK, "", reply_header);
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
 }
 
-void DBServer::endpoint_drop(const msgpack::object& request,
-                             Packer* reply_header,
-                             Packer* reply_data) {
-    reply_header->pack_map(header_sizes::DROP);
+void DBServer::endpoint_drop(const Request& request,
+                             Reply* reply) {
+    reply->header.pack_map(header_sizes::DROP);
     std::map<std::string, std::string> msg;
     try {
-        request.convert(msg);
+        request_options(request.object, &msg);
     } catch (msgpack::type_error& e) {
         // TODO: log error, message cannot be deserialized
         set_status(status_codes::DESERIALIZATION_ERROR,
                    "Deserialization failed.",
                    e.what(),
-                   reply_header);
+                   &reply->header);
         return;
     }
     std::string name;
@@ -123,128 +279,746 @@ void DBServer::endpoint_drop(const msgpack::object& request,
         set_status(status_codes::INVALID_REQUEST,
                    "Missing database name or path.",
                    "",
-                   reply_header);
+                   &reply->header);
+        return;
+    }
+    std::shared_ptr<Database> db;
+    {
+        std::lock_guard<std::mutex> lock(databases_mutex_);
+        std::shared_ptr<const DBContainer> databases(all_databases());
+        auto found = databases->find(name);
+        if (found == databases->end()) {
+            set_status(status_codes::INVALID_REQUEST,
+                       "Database name not found.",
+                       name,
+                       &reply->header);
+            return;
+        }
+        db = found->second;
+        if (db->path() != path) {
+            set_status(status_codes::INVALID_REQUEST,
+                       "Database paths do not match.",
+                       path + " != " + db->path(),
+                       &reply->header);
+            return;
+        }
+        std::shared_ptr<DBContainer> changed(new DBContainer(*databases));
+        changed->erase(name);
+        std::atomic_store(&databases_,
+                          std::shared_ptr<const DBContainer>(changed));
+        // along with its requests still queued, while a database connected
+        // under the same name right after gets a flow of its own
+        workers()->remove_flow(db->flow());
+    }
+    // closing waits for the queries still running on it, which must not
+    // hold up connecting or dropping others
+    db->close();
+    // the snapshot of an in-memory database goes with it as well
+    std::string file = db->file();
+    if (!file.empty())
+        std::remove(file.c_str());
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+}
+
+void DBServer::set_decoding_error(const RequestFields& fields,
+                                  Packer* reply_header) {
+    set_status(status_codes::DESERIALIZATION_ERROR,
+               "Deserialization failed.",
+               std::string("Invalid value of ") + key_name(fields.invalid_key),
+               reply_header);
+}
+
+void DBServer::write_query_header_defaults(Packer* reply_header,
+                                           bool with_cursor) {
+    pack_key(reply_header, header_keys::ROWCOUNT);
+    reply_header->pack(-1);
+    pack_key(reply_header, header_keys::COLUMNS);
+    reply_header->pack_nil();
+    if (with_cursor) {
+        pack_key(reply_header, header_keys::CURSOR);
+        reply_header->pack_nil();
+    }
+}
+
+void DBServer::endpoint_query(const Request& request,
+                              Reply* reply) {
+    const RequestFields& msg = request.fields;
+    if (msg.invalid_key != request_keys::NONE) {
+        // TODO: log error, message cannot be deserialized
+        reply->header.pack_map(header_sizes::QUERY);
+        set_decoding_error(msg, &reply->header);
+        write_query_header_defaults(&reply->header);
+        return;
+    }
+    int header_size = msg.cursor ? header_sizes::CURSOR_QUERY
+                                 : header_sizes::QUERY;
+    reply->header.pack_map(header_size);
+    std::shared_ptr<Database> db = find_database(msg.database);
+    if (!db) {
+        set_status(status_codes::DATABASE_NOT_FOUND,
+                   "Database not found.",
+                   msg.database,
+                   &reply->header);
+        write_query_header_defaults(&reply->header, msg.cursor);
         return;
     }
-    if (!databases_.count(name)) {
+    if (msg.cursor && !cursor_available()) {
         set_status(status_codes::INVALID_REQUEST,
-                   "Database name not found.",
-                   name,
-                   reply_header);
+                   "Too many open cursors.",
+                   "",
+                   &reply->header);
+        write_query_header_defaults(&reply->header, msg.cursor);
+        return;
+    }
+    try {
+        if (msg.cursor) {
+            std::unique_ptr<Cursor> cursor(db->open_cursor(msg.query,
+                                                           msg.parameters,
+                                                           msg.batch_size,
+                                                           msg.format,
+                                                           &reply->header,
+                                                           &reply->data));
+            pack_key(&reply->header, header_keys::CURSOR);
+            if (cursor)
+                reply->header.pack(add_cursor(std::move(cursor)));
+            else
+                reply->header.pack_nil();  // no rows left to fetch
+        } else {
+            db->query(msg.operation,
+                      msg.query,
+                      msg.parameters,
+                      msg.format,
+                      &reply->header,
+                      &reply->data);
+        }
+    } catch (sqlite_error& e) {
+        // TODO: log error, invalid query
+        // rows fetched before the failure must not be sent out
+        reply->clear();
+        reply->header.pack_map(header_size);
+        set_query_error(e, &reply->header);
+        write_query_header_defaults(&reply->header, msg.cursor);
+        return;
+    }
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+}
+
+void DBServer::endpoint_executemany(const Request& request,
+                                    Reply* reply) {
+    reply->header.pack_map(header_sizes::EXECUTEMANY);
+    const RequestFields& msg = request.fields;
+    if (msg.invalid_key != request_keys::NONE) {
+        // TODO: log error, message cannot be deserialized
+        set_decoding_error(msg, &reply->header);
+        write_executemany_header_defaults(&reply->header, -1);
         return;
     }
-    std::shared_ptr<Database> db = databases_.at(name);
-    if (db->path() != path) {
+    const msgpack::object& parameter_sets(msg.parameters);
+    if (parameter_sets.type != msgpack::type::ARRAY) {
         set_status(status_codes::INVALID_REQUEST,
-                   "Database paths do not match.",
-                   path + " != " + db->path(),
-                   reply_header);
+                   "Parameters must be an array of parameter sets.",
+                   "",
+                   &reply->header);
+        write_executemany_header_defaults(&reply->header, -1);
         return;
     }
-    databases_.erase(name);
-    db->close();
-    std::remove(path.c_str());
-    set_status(status_codes::OK, response_messages::OK, "", reply_header);
+    std::shared_ptr<Database> db = find_database(msg.database);
+    if (!db) {
+        set_status(status_codes::DATABASE_NOT_FOUND,
+                   "Database not found.",
+                   msg.database,
+                   &reply->header);
+        write_executemany_header_defaults(&reply->header, -1);
+        return;
+    }
+    uint64_t rowcount;
+    int64_t failed = -1;
+    try {
+        rowcount = db->execute_many(msg.query, parameter_sets, &failed);
+    } catch (sqlite_error& e) {
+        // TODO: log error, invalid query
+        set_query_error(e, &reply->header);
+        write_executemany_header_defaults(&reply->header, failed);
+        return;
+    }
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+    pack_key(&reply->header, header_keys::ROWCOUNT);
+    reply->header.pack(rowcount);
+    pack_key(&reply->header, header_keys::FAILED);
+    reply->header.pack_nil();
 }
 
-void DBServer::write_query_header_defaults(Packer* reply_header) {
-    reply_header->pack(std::string("rowcount"));
+void DBServer::write_executemany_header_defaults(Packer* reply_header,
+                                                 int64_t failed) {
+    pack_key(reply_header, header_keys::ROWCOUNT);
     reply_header->pack(-1);
-    reply_header->pack(std::string("columns"));
-    reply_header->pack_nil();
+    // index of the parameter set that failed, all changes were rolled back
+    pack_key(reply_header, header_keys::FAILED);
+    if (failed < 0)
+        reply_header->pack_nil();
+    else
+        reply_header->pack(failed);
 }
 
-void DBServer::endpoint_query(const msgpack::object& request,
-                              Packer* reply_header,
-                              Packer* reply_data) {
-    reply_header->pack_map(header_sizes::QUERY);
-    MsgType msg;
-    try {
-        request.convert(msg);
-    } catch (msgpack::type_error& e) {
+void DBServer::endpoint_batch(const Request& request, Reply* reply) {
+    reply->header.pack_map(header_sizes::BATCH);
+    const RequestFields& msg = request.fields;
+    if (msg.invalid_key != request_keys::NONE) {
         // TODO: log error, message cannot be deserialized
-        set_status(status_codes::DESERIALIZATION_ERROR,
-                   "Deserialization failed.",
-                   e.what(),
-                   reply_header);
-        write_query_header_defaults(reply_header);
+        set_decoding_error(msg, &reply->header);
+        write_batch_header_defaults(&reply->header, -1);
         return;
     }
-    if (!databases_.count(msg.database)) {
+    std::shared_ptr<Database> db = find_database(msg.database);
+    if (!db) {
         set_status(status_codes::DATABASE_NOT_FOUND,
                    "Database not found.",
                    msg.database,
-                   reply_header);
+                   &reply->header);
+        write_batch_header_defaults(&reply->header, -1);
         return;
     }
-    Database& db = *databases_.at(msg.database);
+    int64_t failed = -1;
     try {
-        db.query(msg.operation,
-                 msg.query,
-                 msg.parameters,
-                 reply_header,
-                 reply_data);
+        db->batch(msg.items.data(),
+                  msg.item_count,
+                  msg.immediate,
+                  &reply->data_buf,
+                  &failed);
     } catch (sqlite_error& e) {
         // TODO: log error, invalid query
-        set_status(status_codes::INVALID_QUERY,
-                   e.what(),
-                   e.extended(),
-                   reply_header);
-        write_query_header_defaults(reply_header);
+        // everything was rolled back, so none of the results are valid
+        reply->data_buf.clear();
+        set_query_error(e, &reply->header);
+        write_batch_header_defaults(&reply->header, failed);
         return;
     }
-    set_status(status_codes::OK, response_messages::OK, "", reply_header);
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+    // each item is followed by its own header and rows in the reply data
+    pack_key(&reply->header, header_keys::RESULTS);
+    reply->header.pack(msg.item_count);
+    pack_key(&reply->header, header_keys::FAILED);
+    reply->header.pack_nil();
 }
 
-DBServer::endpoint_fn DBServer::identify_endpoint(const msgpack::object& request) {
-    RequestData data(request.as<RequestData>());
-    msgpack::object endpoint_name;
+void DBServer::write_batch_header_defaults(Packer* reply_header,
+                                           int64_t failed) {
+    pack_key(reply_header, header_keys::RESULTS);
+    reply_header->pack(0);
+    // index of the item that failed, all of them were rolled back
+    pack_key(reply_header, header_keys::FAILED);
+    if (failed < 0)
+        reply_header->pack_nil();
+    else
+        reply_header->pack(failed);
+}
+
+void DBServer::endpoint_fetch(const Request& request, Reply* reply) {
+    reply->header.pack_map(header_sizes::FETCH);
+    const RequestFields& fields = request.fields;
+    if (fields.invalid_key != request_keys::NONE) {
+        set_decoding_error(fields, &reply->header);
+        write_fetch_header_defaults(&reply->header);
+        return;
+    }
+    if (!fields.has_cursor_id) {
+        set_status(status_codes::INVALID_REQUEST,
+                   "Missing cursor id.",
+                   "",
+                   &reply->header);
+        write_fetch_header_defaults(&reply->header);
+        return;
+    }
+    uint64_t cursor_id = fields.cursor_id;
+    uint64_t batch_size = fields.batch_size;
+    std::shared_ptr<Cursor> cursor = find_cursor(cursor_id);
+    if (!cursor) {
+        set_status(status_codes::CURSOR_NOT_FOUND,
+                   "Cursor not found.",
+                   std::to_string(cursor_id),
+                   &reply->header);
+        write_fetch_header_defaults(&reply->header);
+        return;
+    }
+    bool done;
+    uint64_t rowcount;
     try {
-        endpoint_name = data.at("endpoint");
-    } catch (std::out_of_range& e) {
-        throw invalid_request("Missing endpoint name");
+        rowcount = cursor->fetch(batch_size, &reply->data, &done);
+    } catch (sqlite_error& e) {
+        // TODO: log error
+        remove_cursor(cursor_id);
+        reply->clear();
+        reply->header.pack_map(header_sizes::FETCH);
+        set_query_error(e, &reply->header);
+        write_fetch_header_defaults(&reply->header);
+        return;
     }
-    if (endpoint_name.type != msgpack::type::STR)
-        throw invalid_request("Invalid endpoint name");
+    if (done)
+        remove_cursor(cursor_id);
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+    pack_key(&reply->header, header_keys::ROWCOUNT);
+    reply->header.pack(rowcount);
+    pack_key(&reply->header, header_keys::CURSOR);
+    if (done)
+        reply->header.pack_nil();
+    else
+        reply->header.pack(cursor_id);
+}
 
-    DBServer::endpoint_fn endpoint;
-    std::string name(endpoint_name.via.str.ptr, endpoint_name.via.str.size);
+void DBServer::write_fetch_header_defaults(Packer* reply_header) {
+    pack_key(reply_header, header_keys::ROWCOUNT);
+    reply_header->pack(-1);
+    pack_key(reply_header, header_keys::CURSOR);
+    reply_header->pack_nil();
+}
+
+void DBServer::endpoint_close(const Request& request, Reply* reply) {
+    reply->header.pack_map(header_sizes::CLOSE);
+    const RequestFields& fields = request.fields;
+    if (fields.invalid_key != request_keys::NONE) {
+        set_decoding_error(fields, &reply->header);
+        return;
+    }
+    if (!fields.has_cursor_id) {
+        set_status(status_codes::INVALID_REQUEST,
+                   "Missing cursor id.",
+                   "",
+                   &reply->header);
+        return;
+    }
+    uint64_t cursor_id = fields.cursor_id;
+    if (!remove_cursor(cursor_id)) {
+        set_status(status_codes::CURSOR_NOT_FOUND,
+                   "Cursor not found.",
+                   std::to_string(cursor_id),
+                   &reply->header);
+        return;
+    }
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+}
+
+void DBServer::endpoint_cancel(const Request& request, Reply* reply) {
+    reply->header.pack_map(header_sizes::CANCEL);
+    const RequestFields& fields = request.fields;
+    if (fields.invalid_key != request_keys::NONE) {
+        set_decoding_error(fields, &reply->header);
+        pack_key(&reply->header, header_keys::CANCELLED);
+        reply->header.pack(0);
+        return;
+    }
+    if (!fields.has_request_id) {
+        set_status(status_codes::INVALID_REQUEST,
+                   "Missing request id.",
+                   "",
+                   &reply->header);
+        pack_key(&reply->header, header_keys::CANCELLED);
+        reply->header.pack(0);
+        return;
+    }
+    // the requests were cancelled when this one was decoded, see handle
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+    pack_key(&reply->header, header_keys::CANCELLED);
+    reply->header.pack(request.cancelled);
+}
+
+void DBServer::endpoint_snapshot(const Request& request, Reply* reply) {
+    reply->header.pack_map(header_sizes::SNAPSHOT);
+    const RequestFields& fields = request.fields;
+    if (fields.invalid_key != request_keys::NONE) {
+        set_decoding_error(fields, &reply->header);
+        return;
+    }
+    std::shared_ptr<Database> db = find_database(fields.database);
+    if (!db) {
+        set_status(status_codes::DATABASE_NOT_FOUND,
+                   "Database not found.",
+                   fields.database,
+                   &reply->header);
+        return;
+    }
+    if (db->snapshot_path().empty()) {
+        set_status(status_codes::INVALID_REQUEST,
+                   "Database has no snapshot file.",
+                   fields.database,
+                   &reply->header);
+        return;
+    }
     try {
-        endpoint = endpoints_[name];
-    } catch (std::out_of_range& e) {
-        throw invalid_request("Unknown endpoint specified");
+        db->snapshot();
+    } catch (sqlite_error& e) {
+        set_query_error(e, &reply->header);
+        return;
+    }
+    set_status(status_codes::OK, response_messages::OK, "", &reply->header);
+}
+
+bool DBServer::cursor_available() {
+    // close cursors abandoned by their clients first
+    std::chrono::steady_clock::time_point since(
+                                    std::chrono::steady_clock::now() -
+                                    std::chrono::seconds(CURSOR_IDLE_TIMEOUT));
+    std::vector<std::shared_ptr<Cursor>> expired;
+    std::lock_guard<std::mutex> lock(cursors_mutex_);
+    for (auto it = cursors_.begin(); it != cursors_.end();) {
+        if (it->second->idle_since(since)) {
+            expired.push_back(it->second);
+            it = cursors_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return cursors_.size() < MAX_OPEN_CURSORS;
+}
+
+uint64_t DBServer::add_cursor(std::unique_ptr<Cursor> cursor) {
+    std::lock_guard<std::mutex> lock(cursors_mutex_);
+    uint64_t id = next_cursor_id_++;
+    cursors_.insert(std::make_pair(id, std::shared_ptr<Cursor>(std::move(cursor))));
+    return id;
+}
+
+std::shared_ptr<Cursor> DBServer::find_cursor(uint64_t id) {
+    std::lock_guard<std::mutex> lock(cursors_mutex_);
+    auto found = cursors_.find(id);
+    if (found == cursors_.end())
+        return std::shared_ptr<Cursor>();
+    return found->second;
+}
+
+bool DBServer::remove_cursor(uint64_t id) {
+    // the cursor is destroyed outside of the lock, as that waits for its
+    // connection
+    std::shared_ptr<Cursor> cursor;
+    std::lock_guard<std::mutex> lock(cursors_mutex_);
+    auto found = cursors_.find(id);
+    if (found == cursors_.end())
+        return false;
+    cursor = found->second;
+    cursors_.erase(found);
+    return true;
+}
+
+std::shared_ptr<Database> DBServer::find_database(const std::string& name) {
+    std::shared_ptr<const DBContainer> databases(all_databases());
+    auto found = databases->find(name);
+    if (found == databases->end())
+        return std::shared_ptr<Database>();
+    return found->second;
+}
+
+std::shared_ptr<const DBContainer> DBServer::all_databases() {
+    return std::atomic_load(&databases_);
+}
+
+void pack_counter(const std::string& name, uint64_t value, Packer* packer) {
+    packer->pack(name);
+    packer->pack(value);
+}
+
+void pack_sqlite_status(const std::string& name, int op, Packer* packer) {
+    sqlite3_int64 current = 0;
+    sqlite3_int64 highwater = 0;
+    sqlite3_status64(op, &current, &highwater, 0);
+    packer->pack(name);
+    packer->pack_map(2);
+    pack_counter("current", current, packer);
+    pack_counter("highwater", highwater, packer);
+}
+
+void DBServer::endpoint_stats(const Request& /* request */, Reply* reply) {
+    Packer* header = &reply->header;
+    header->pack_map(header_sizes::STATS);
+    set_status(status_codes::OK, response_messages::OK, "", header);
+    // network and request counters of all reactors
+    tcpserver::ServerStats* server = stats();
+    size_t cursor_count;
+    {
+        std::lock_guard<std::mutex> lock(cursors_mutex_);
+        cursor_count = cursors_.size();
+    }
+    header->pack(std::string("server"));
+    header->pack_map(tcpserver::HEAP_ALLOCATIONS_COUNTED ? 10 : 9);
+    pack_counter("connections", server->connections, header);
+    pack_counter("accepted", server->accepted, header);
+    pack_counter("bytes_received", server->bytes_received, header);
+    pack_counter("bytes_sent", server->bytes_sent, header);
+    pack_counter("requests", server->requests, header);
+    pack_counter("pending_requests", server->pending_requests, header);
+    pack_counter("workers", workers()->size(), header);
+    pack_counter("queued_jobs", workers()->queued(), header);
+    pack_counter("cursors", cursor_count, header);
+    if (tcpserver::HEAP_ALLOCATIONS_COUNTED)
+        pack_counter("heap_allocations",
+                     tcpserver::heap_allocations(),
+                     header);
+    // endpoints are fixed after construction, so no lock is needed
+    header->pack(std::string("endpoints"));
+    size_t endpoint_count = 0;
+    for (uint8_t opcode = 0; opcode < opcodes::COUNT; ++opcode) {
+        if (endpoints_[opcode].fn != NULL)
+            endpoint_count += 1;
     }
+    header->pack_map(endpoint_count);
+    for (uint8_t opcode = 0; opcode < opcodes::COUNT; ++opcode) {
+        if (endpoints_[opcode].fn == NULL)
+            continue;
+        header->pack(std::string(opcode_name(opcode)));
+        endpoints_[opcode].latency->pack(header);
+    }
+    // process wide memory figures of sqlite
+    header->pack(std::string("sqlite"));
+    header->pack_map(3);
+    pack_sqlite_status("memory_used", SQLITE_STATUS_MEMORY_USED, header);
+    pack_sqlite_status("malloc_count", SQLITE_STATUS_MALLOC_COUNT, header);
+    pack_sqlite_status("pagecache_overflow",
+                       SQLITE_STATUS_PAGECACHE_OVERFLOW,
+                       header);
+    // reading the stats of a database waits for its connections, which
+    // connect and drop need not wait for as they replace the map anyway
+    std::shared_ptr<const DBContainer> databases(all_databases());
+    HandleStats handles = handles_.stats();
+    header->pack(std::string("handles"));
+    header->pack_map(5);
+    pack_counter("open", handles.open, header);
+    pack_counter("max_open", handles.max_open, header);
+    pack_counter("opens", handles.opens, header);
+    pack_counter("idle_closes", handles.idle_closes, header);
+    pack_counter("evictions", handles.evictions, header);
+    header->pack(std::string("databases"));
+    header->pack_map(databases->size());
+    for (auto it = databases->begin(); it != databases->end(); ++it) {
+        CacheStats cache = it->second->cache_stats();
+        ResultCacheStats results = it->second->result_cache_stats();
+        ConnectionStatus status = it->second->status();
+        header->pack(it->first);
+        header->pack_map(9);
+        pack_counter("open", it->second->is_open() ? 1 : 0, header);
+        pack_counter("readers", it->second->reader_count(), header);
+        pack_counter("reads", it->second->reads(), header);
+        header->pack(std::string("group_commit"));
+        header->pack_map(2);
+        pack_counter("groups", it->second->groups(), header);
+        pack_counter("writes", it->second->grouped_writes(), header);
+        header->pack(std::string("snapshots"));
+        header->pack_map(2);
+        pack_counter("saved", it->second->snapshots(), header);
+        pack_counter("errors", it->second->snapshot_errors(), header);
+        header->pack(std::string("latency"));
+        it->second->latency()->pack(header);
+        header->pack(std::string("statement_cache"));
+        header->pack_map(5);
+        pack_counter("size", cache.size, header);
+        pack_counter("capacity", cache.capacity, header);
+        pack_counter("hits", cache.hits, header);
+        pack_counter("misses", cache.misses, header);
+        pack_counter("evictions", cache.evictions, header);
+        header->pack(std::string("result_cache"));
+        header->pack_map(7);
+        pack_counter("size", results.size, header);
+        pack_counter("capacity", results.capacity, header);
+        pack_counter("entries", results.entries, header);
+        pack_counter("hits", results.hits, header);
+        pack_counter("misses", results.misses, header);
+        pack_counter("evictions", results.evictions, header);
+        pack_counter("invalidations", results.invalidations, header);
+        header->pack(std::string("memory"));
+        header->pack_map(5);
+        pack_counter("cache_used", status.cache_used, header);
+        pack_counter("schema_used", status.schema_used, header);
+        pack_counter("statements_used", status.statements_used, header);
+        pack_counter("cache_hits", status.cache_hits, header);
+        pack_counter("cache_misses", status.cache_misses, header);
+    }
+}
+
+DBServer::Endpoint* DBServer::identify_endpoint(const RequestFields& fields) {
+    if (fields.endpoint_error != NULL)
+        throw invalid_request(fields.endpoint_error);
+    Endpoint* endpoint = &endpoints_[fields.opcode];
+    if (endpoint->fn == NULL)
+        throw invalid_request("Unknown endpoint specified");
     return endpoint;
 }
 
-void DBServer::handle(const byte_vec& input, byte_vec* output) {
-    // unpack incoming data
-    msgpack::unpacked result;
-    std::string str_input(input.begin(), input.end());
-    msgpack::unpack(result, str_input.data(), input.size());
-    msgpack::object request(result.get());
-    // prepare reply object
-    msgpack::sbuffer header_buf;
-    msgpack::sbuffer data_buf;
-    Packer reply_header(&header_buf);
-    Packer reply_data(&data_buf);
+void DBServer::schedule(const RequestFields& fields,
+                        tcpserver::flow_id* flow,
+                        bool* write) {
+    // anything else, such as fetching from cursors and the control
+    // endpoints, is short and shares the default flow as reads
+    *flow = tcpserver::DEFAULT_FLOW;
+    *write = false;
+    if (fields.opcode == opcodes::NONE || fields.database.empty())
+        return;
+    std::shared_ptr<Database> db = find_database(fields.database);
+    if (!db)
+        return;
+    *flow = db->flow();
+    *write = true;
+    // only queries returning all of their rows at once are short enough to
+    // be scheduled as reads, and only once they were seen to not write
+    if (fields.opcode != opcodes::QUERY || fields.cursor)
+        return;
+    *write = !db->known_read_only(fields.query);
+}
+
+void DBServer::track(Request* request) {
+    if (!request->fields.has_id)
+        return;
+    request->tracked = true;
+    std::lock_guard<std::mutex> lock(tracked_mutex_);
+    tracked_.insert(std::make_pair(
+            std::make_pair(request->client, request->fields.id), request));
+}
+
+uint64_t DBServer::cancel(uint64_t client, uint64_t request_id) {
+    // requests still waiting for their turn are cancelled as well, they
+    // are answered without being executed at all
+    uint64_t cancelled = 0;
+    std::lock_guard<std::mutex> lock(tracked_mutex_);
+    auto range = tracked_.equal_range(std::make_pair(client, request_id));
+    for (auto it = range.first; it != range.second; ++it) {
+        it->second->control.cancel();
+        cancelled += 1;
+    }
+    return cancelled;
+}
+
+void DBServer::release(Request* request) {
+    if (request->tracked) {
+        std::lock_guard<std::mutex> lock(tracked_mutex_);
+        auto range = tracked_.equal_range(
+                std::make_pair(request->client, request->fields.id));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == request) {
+                tracked_.erase(it);
+                break;
+            }
+        }
+    }
+    requests_.release(request);
+}
+
+void DBServer::dispatch(Request* request, tcpserver::OutputQueue* output) {
+    if (output == NULL) {
+        // the connection was closed before the request got its turn
+        release(request);
+        return;
+    }
+    Reply& reply = request->reply;
+    // statements run on this thread are stopped by the request's control
+    QueryControl::Scope scope(&request->control);
     // identify endpoint function based on request data
-    endpoint_fn endpoint;
     try {
-        endpoint = identify_endpoint(request);
+        const RequestFields& fields = request->fields;
+        Endpoint* endpoint = identify_endpoint(fields);
+        if (fields.invalid_key == request_keys::TIMEOUT_MS)
+            throw invalid_request("Invalid timeout");
+        // counted from now, time spent queued is not included
+        if (fields.has_timeout)
+            request->control.set_timeout(fields.timeout_ms);
+        Timer timer(endpoint->latency.get());
+        if (request->control.cancelled()) {
+            reply.header.pack_map(header_sizes::STATUS);
+            set_status(status_codes::QUERY_CANCELLED,
+                       "Query cancelled.",
+                       "",
+                       &reply.header);
+        } else {
+            // get reply from endpoint function
+            (this->*endpoint->fn)(*request, &reply);
+        }
     } catch (invalid_request& e) {
-        set_status(status_codes::INVALID_REQUEST, e.what(), "", &reply_header);
+        reply.header.pack_map(header_sizes::STATUS);
+        set_status(status_codes::INVALID_REQUEST, e.what(), "", &reply.header);
+    } catch (std::exception& e) {
+        // TODO: log error
+        // replies of the following pipelined requests must stay intact
+        reply.clear();
+        reply.header.pack_map(header_sizes::STATUS);
+        set_status(status_codes::UNKNOWN_ERROR, e.what(), "", &reply.header);
+    }
+    size_t header_size = reply.header_buf.size();
+    size_t data_size = reply.data_buf.size();
+    if (header_size + data_size <= REPLY_COPY_LIMIT) {
+        // small replies are copied, so that the buffers they were packed
+        // into go back to the pool with the request and are reused
+        output->write(reply.header_buf.data(), header_size);
+        output->write(reply.data_buf.data(), data_size);
+    } else {
+        // hand the serialized buffers over to the output queue as they are,
+        // large row data is sent straight from where it was packed
+        output->push(reply.header_buf.release(), header_size);
+        output->push(reply.data_buf.release(), data_size);
     }
-    // get reply from endpoint function
-    (this->*endpoint)(request, &reply_header, &reply_data);
-    // write serialized reply data into output buffer
-    output->insert(output->end(),
-                   header_buf.data(),
-                   header_buf.data() + header_buf.size());
-    output->insert(output->end(),
-                   data_buf.data(),
-                   data_buf.data() + data_buf.size());
+    release(request);
 }
 
-}  // namespace sqlizator
+// strings and blobs of a request are left where they are in the receive
+// buffer instead of being copied into the unpacker's zone
+bool reference_in_place(msgpack::type::object_type /* type */,
+                        size_t /* length */,
+                        void* /* user_data */) {
+    return true;
+}
 
+size_t DBServer::handle(const shared_byte_vec& input,
+                        tcpserver::connection_state* state,
+                        tcpserver::job_queue* jobs) {
+    if (!*state)
+        state->reset(new ClientState(next_client_id_++));
+    ClientState* client = static_cast<ClientState*>(state->get());
+    RequestScanner* scanner = &client->scanner;
+    // requests are self-delimiting msgpack objects, so unpack as many as are
+    // complete in the input and leave a trailing partial one buffered. the
+    // scanner remembers how far it got into that one for the next call
+    const char* data = reinterpret_cast<const char*>(input->data());
+    size_t size = input->size();
+    size_t offset = 0;
+    while (offset < size) {
+        size_t length = scanner->scan(input->data() + offset,
+                                      size - offset,
+                                      tcpserver::MAX_REQUEST_SIZE);
+        if (length == 0)
+            break;
+        Request* request = requests_.acquire();
+        size_t next = offset;
+        try {
+            bool referenced;
+            request->object = msgpack::unpack(request->zone,
+                                              data,
+                                              offset + length,
+                                              next,
+                                              referenced,
+                                              reference_in_place);
+        } catch (msgpack::unpack_error& e) {
+            requests_.release(request);
+            throw tcpserver::protocol_error(e.what());
+        }
+        offset = next;
+        // the request holds on to the input, which its objects point into,
+        // until its reply is complete
+        request->input = input;
+        request->client = client->client;
+        // decoded once, for scheduling as well as for the endpoint
+        decode_request(request->object, &request->fields);
+        track(request);
+        // requests of a connection run one at a time, so cancelling cannot
+        // wait for its turn. the requests it stops were decoded before it,
+        // so they still reply first
+        const RequestFields& fields = request->fields;
+        if (fields.opcode == opcodes::CANCEL &&
+                fields.invalid_key == request_keys::NONE &&
+                fields.has_request_id)
+            request->cancelled = cancel(client->client, fields.request_id);
+        tcpserver::flow_id flow;
+        bool write;
+        schedule(request->fields, &flow, &write);
+        jobs->push_back(tcpserver::Job([this, request](
+                                               tcpserver::OutputQueue* output) {
+            dispatch(request, output);
+        }, flow, write));
+    }
+    return offset;
+}
+
+}  // namespace sqlizator
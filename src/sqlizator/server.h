@@ -4,103 +4,136 @@
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
 #ifndef SQLIZATOR_SQLIZATOR_SERVER_H_
 #define SQLIZATOR_SQLIZATOR_SERVER_H_
+#include <stdint.h>
+
+#include <atomic>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "sqlizator/cursor.h"
 #include "sqlizator/database.h"
+#include "sqlizator/exceptions.h"
+#include "sqlizator/handlepool.h"
+#include "sqlizator/histogram.h"
+#include "sqlizator/protocol.h"
+#include "sqlizator/querylog.h"
+#include "sqlizator/requestpool.h"
+#include "sqlizator/requestscanner.h"
 #include "sqlizator/response.h"
+#include "sqlizator/snapshotwriter.h"
 #include "tcpserver/server.h"
 
 namespace sqlizator {
 
-using tcpserver::byte_vec;
+using tcpserver::shared_byte_vec;
+// replies up to this size are copied into the output queue, larger ones are
+// handed over in the buffers they were packed into
+static const size_t REPLY_COPY_LIMIT = tcpserver::CHUNK_SIZE;
 typedef std::map<std::string, std::shared_ptr<Database>> DBContainer;
-typedef std::map<std::string, msgpack::object> RequestData;
+typedef std::map<uint64_t, std::shared_ptr<Cursor>> CursorMap;
+// requests which can be cancelled, by their client connection and the id
+// the client gave them, so that clients cannot cancel each other's
+typedef std::multimap<std::pair<uint64_t, uint64_t>, Request*> RequestIndex;
+
+// what is kept about a client connection between reads
+struct ClientState: public tcpserver::ConnectionState {
+    // unique for the lifetime of the server, unlike the socket
+    uint64_t client;
+    RequestScanner scanner;
 
-struct MsgType {
-    std::string database;
-    std::string query;
-    Operation operation;
-    msgpack::object_handle parameters;
+    explicit ClientState(uint64_t client): client(client) {}
 };
 
 class DBServer: public tcpserver::Server {
  private:
-    typedef void (DBServer::*endpoint_fn)(const msgpack::object& request,
-                                          Packer* reply_header,
-                                          Packer* reply_data);
-    typedef std::map<std::string, endpoint_fn> EndpointMap;
-    DBContainer databases_;
-    EndpointMap endpoints_;
+    typedef void (DBServer::*endpoint_fn)(const Request& request,
+                                          Reply* reply);
+    struct Endpoint {
+        endpoint_fn fn;
+        // time from the start of the request until its reply is complete
+        std::unique_ptr<Histogram> latency;
+
+        Endpoint(): fn(NULL) {}
+    };
+    // outlives the databases reporting to it
+    HandlePool handles_;
+    // replaced as a whole by connect and drop, so that looking a database
+    // up, which the reactors do for every request, never waits for them.
+    // read and replaced with the atomic shared_ptr functions
+    std::shared_ptr<const DBContainer> databases_;
+    // serializes the changes of databases_, each database serializes its
+    // own queries
+    std::mutex databases_mutex_;
+    // stopped before the databases it saves are destroyed
+    SnapshotWriter snapshots_;
+    // indexed by opcode
+    Endpoint endpoints_[opcodes::COUNT];
+    CursorMap cursors_;
+    std::mutex cursors_mutex_;
+    uint64_t next_cursor_id_;
+    QueryLog* query_log_;
+    RequestPool requests_;
+    RequestIndex tracked_;
+    std::mutex tracked_mutex_;
+    std::atomic<uint64_t> next_client_id_;
 
     void set_status(int status,
                     const std::string& message,
                     const std::string& extended,
                     Packer* reply_header);
-    void write_query_header_defaults(Packer* reply_header);
-    void endpoint_connect(const msgpack::object& request,
-                          Packer* reply_header,
-                          Packer* reply_data);
-    void endpoint_drop(const msgpack::object& request,
-                       Packer* reply_header,
-                       Packer* reply_data);
-    void endpoint_query(const msgpack::object& request,
-                        Packer* reply_header,
-                        Packer* reply_data);
-    endpoint_fn identify_endpoint(const msgpack::object& request);
-    virtual void handle(const byte_vec& input, byte_vec* output);
+    void set_query_error(sqlite_error& e, Packer* reply_header);
+    void set_decoding_error(const RequestFields& fields, Packer* reply_header);
+    void write_query_header_defaults(Packer* reply_header,
+                                     bool with_cursor = false);
+    void write_executemany_header_defaults(Packer* reply_header,
+                                           int64_t failed);
+    void write_batch_header_defaults(Packer* reply_header, int64_t failed);
+    void write_fetch_header_defaults(Packer* reply_header);
+    void endpoint_connect(const Request& request, Reply* reply);
+    void endpoint_drop(const Request& request, Reply* reply);
+    void endpoint_query(const Request& request, Reply* reply);
+    void endpoint_executemany(const Request& request, Reply* reply);
+    void endpoint_batch(const Request& request, Reply* reply);
+    void endpoint_fetch(const Request& request, Reply* reply);
+    void endpoint_close(const Request& request, Reply* reply);
+    void endpoint_stats(const Request& request, Reply* reply);
+    void endpoint_cancel(const Request& request, Reply* reply);
+    void endpoint_snapshot(const Request& request, Reply* reply);
+    std::shared_ptr<Database> find_database(const std::string& name);
+    // the databases as they are now, unaffected by later changes
+    std::shared_ptr<const DBContainer> all_databases();
+    bool cursor_available();
+    uint64_t add_cursor(std::unique_ptr<Cursor> cursor);
+    std::shared_ptr<Cursor> find_cursor(uint64_t id);
+    bool remove_cursor(uint64_t id);
+    void add_endpoint(uint8_t opcode, endpoint_fn fn);
+    Endpoint* identify_endpoint(const RequestFields& fields);
+    void schedule(const RequestFields& fields,
+                  tcpserver::flow_id* flow,
+                  bool* write);
+    void track(Request* request);
+    // stops the tracked requests of a client with the given id, returns
+    // how many there were
+    uint64_t cancel(uint64_t client, uint64_t request_id);
+    void release(Request* request);
+    void dispatch(Request* request, tcpserver::OutputQueue* output);
+    virtual size_t handle(const shared_byte_vec& input,
+                          tcpserver::connection_state* state,
+                          tcpserver::job_queue* jobs);
 
  public:
-    explicit DBServer(const std::string& port);
+    DBServer(const std::string& port,
+             const std::string& unix_path,
+             size_t workers = 0,
+             size_t reactors = 1,
+             QueryLog* query_log = NULL,
+             size_t max_open_databases = 0,
+             uint64_t idle_timeout_ms = 0);
 };
 
 }  // namespace sqlizator
-
-
-namespace msgpack {
-MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
-namespace adaptor {
-
-template<>
-struct convert<sqlizator::MsgType> {
-    msgpack::object const& operator()(msgpack::object const& o,
-                                      sqlizator::MsgType& v) const {
-        if (o.type != msgpack::type::MAP)
-            throw msgpack::type_error();
-
-        msgpack::object_kv* p_mo(o.via.map.ptr);
-        msgpack::object_kv* const p_mo_end(p_mo + o.via.map.size);
-        for (; p_mo < p_mo_end; ++p_mo) {
-            if (p_mo->key.type != msgpack::type::STR)
-                throw msgpack::type_error();
-
-            std::string key(p_mo->key.via.str.ptr, p_mo->key.via.str.size);
-            if (key == "database") {
-                if (p_mo->val.type != msgpack::type::STR)
-                    throw msgpack::type_error();
-                v.database = std::string(p_mo->val.via.str.ptr, p_mo->val.via.str.size);
-            } else if (key == "query") {
-                if (p_mo->val.type != msgpack::type::STR)
-                    throw msgpack::type_error();
-                v.query = std::string(p_mo->val.via.str.ptr, p_mo->val.via.str.size);
-            } else if (key == "operation") {
-                if (p_mo->val.type != msgpack::type::POSITIVE_INTEGER)
-                    throw msgpack::type_error();
-                v.operation = static_cast<sqlizator::Operation>(p_mo->val.via.u64);
-            } else if (key == "parameters") {
-                if (p_mo->val.type != msgpack::type::ARRAY &&
-                        p_mo->val.type != msgpack::type::MAP)
-                    throw msgpack::type_error();
-                v.parameters = msgpack::clone(p_mo->val);
-            }
-        }
-        return o;
-    }
-};
-
-} // namespace adaptor
-} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
-} // namespace msgpack
-
 #endif  // SQLIZATOR_SQLIZATOR_SERVER_H_
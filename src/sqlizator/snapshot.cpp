@@ -0,0 +1,55 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <sqlite3.h>
+
+#include <string>
+
+#include "sqlizator/exceptions.h"
+#include "sqlizator/snapshot.h"
+
+namespace sqlizator {
+
+Snapshot::Snapshot(const std::string& path): path_(path),
+                                             file_(NULL),
+                                             backup_(NULL) {
+    int ret = sqlite3_open_v2(path.c_str(),
+                              &file_,
+                              SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                              NULL);
+    if (ret != SQLITE_OK) {
+        std::string extended(sqlite3_errmsg(file_));
+        sqlite3_close(file_);
+        throw sqlite_error(sqlite3_errstr(ret), extended);
+    }
+}
+
+Snapshot::~Snapshot() {
+    // an unfinished copy is rolled back
+    if (backup_ != NULL)
+        sqlite3_backup_finish(backup_);
+    sqlite3_close(file_);
+}
+
+int Snapshot::step(sqlite3* source, int pages) {
+    if (backup_ == NULL) {
+        backup_ = sqlite3_backup_init(file_, "main", source, "main");
+        if (backup_ == NULL)
+            throw sqlite_error(sqlite3_errstr(sqlite3_errcode(file_)),
+                               sqlite3_errmsg(file_));
+    }
+    int ret = sqlite3_backup_step(backup_, pages);
+    if (ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED)
+        return ret;
+    // done or failed, either way finishing tells whether it was written
+    int finished = sqlite3_backup_finish(backup_);
+    backup_ = NULL;
+    if (ret != SQLITE_DONE)
+        throw sqlite_error(sqlite3_errstr(ret), path_);
+    if (finished != SQLITE_OK)
+        throw sqlite_error(sqlite3_errstr(finished), sqlite3_errmsg(file_));
+    return ret;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,44 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_SNAPSHOT_H_
+#define SQLIZATOR_SQLIZATOR_SNAPSHOT_H_
+#include <sqlite3.h>
+
+#include <string>
+
+namespace sqlizator {
+
+// pages copied per step of a snapshot, the connection it is taken from
+// serves other statements in between
+static const int SNAPSHOT_STEP_PAGES = 256;
+
+// A copy of a database into a file, made with sqlite3_backup a few pages
+// at a time. The copy is written within a transaction of the file, so the
+// file keeps its previous content until the copy is complete, and gets it
+// back if the copy is abandoned or the process dies midway. Changes made
+// in between steps through the connection that is copied are carried over
+// by sqlite, while a write transaction being open on it holds the copy up.
+class Snapshot {
+ private:
+    std::string path_;
+    sqlite3* file_;
+    sqlite3_backup* backup_;
+
+ public:
+    // opens, or creates, the file. throws sqlite_error
+    explicit Snapshot(const std::string& path);
+    ~Snapshot();
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+    // copies the next `pages` pages of `source`, which must be the same
+    // connection each time and not be used by another thread meanwhile.
+    // returns SQLITE_DONE once the copy is complete, SQLITE_OK if there is
+    // more to copy, or SQLITE_BUSY or SQLITE_LOCKED if it has to wait for a
+    // write. throws sqlite_error for anything else
+    int step(sqlite3* source, int pages);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_SNAPSHOT_H_
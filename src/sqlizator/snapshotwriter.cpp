@@ -0,0 +1,62 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sqlizator/database.h"
+#include "sqlizator/snapshotwriter.h"
+
+namespace sqlizator {
+
+SnapshotWriter::SnapshotWriter(): stopping_(false) {}
+
+SnapshotWriter::~SnapshotWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void SnapshotWriter::add(const std::shared_ptr<Database>& db) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    databases_.push_back(db);
+    if (!thread_.joinable())
+        thread_ = std::thread(&SnapshotWriter::run, this);
+}
+
+void SnapshotWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        cond_.wait_for(lock, std::chrono::milliseconds(SNAPSHOT_CHECK_INTERVAL));
+        if (stopping_)
+            return;
+        std::vector<std::shared_ptr<Database>> databases;
+        for (auto it = databases_.begin(); it != databases_.end();) {
+            std::shared_ptr<Database> db = it->lock();
+            if (db) {
+                databases.push_back(db);
+                ++it;
+            } else {
+                it = databases_.erase(it);
+            }
+        }
+        // snapshots take a while, databases may be added meanwhile
+        lock.unlock();
+        std::chrono::steady_clock::time_point now(
+                                        std::chrono::steady_clock::now());
+        for (auto it = databases.begin(); it != databases.end(); ++it)
+            (*it)->snapshot_if_due(now);
+        databases.clear();
+        lock.lock();
+    }
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,44 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_SNAPSHOTWRITER_H_
+#define SQLIZATOR_SQLIZATOR_SNAPSHOTWRITER_H_
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sqlizator {
+
+class Database;
+
+// how often, in milliseconds, in-memory databases are checked for a
+// snapshot being due
+static const int SNAPSHOT_CHECK_INTERVAL = 100;
+
+// Saves in-memory databases to their snapshot files in the background,
+// each on its own interval, from a thread started along with the first
+// database added. Databases are only referenced weakly, those dropped in
+// the meantime are forgotten.
+class SnapshotWriter {
+ private:
+    std::vector<std::weak_ptr<Database>> databases_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+
+    void run();
+
+ public:
+    SnapshotWriter();
+    ~SnapshotWriter();
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+    void add(const std::shared_ptr<Database>& db);
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_SNAPSHOTWRITER_H_
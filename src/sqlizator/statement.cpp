@@ -2,14 +2,15 @@
 // Some rights reserved.
 // This software is free software licensed under the terms of GPLv3. See COPYING
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <endian.h>
 #include <stdint.h>
 
 #include <sqlite3.h>
 #include <msgpack.hpp>
 
-#include <map>
+#include <cctype>
+#include <cstring>
 #include <string>
-#include <vector>
 
 #include "sqlizator/exceptions.h"
 #include "sqlizator/response.h"
@@ -17,7 +18,36 @@
 
 namespace sqlizator {
 
-int Statement::bind_param(const msgpack::object& v, int pos) {
+// gathered columns holding more than this many rows are freed once packed,
+// instead of keeping their storage with the cached statement
+static const size_t MAX_RETAINED_COLUMN_ROWS = 65536;
+
+// built-in functions whose result may change while the data stays the same.
+// the date and time functions only do so when asked for the current time,
+// which is not told apart from other uses of them
+static const char* const VOLATILE_FUNCTIONS[] = {
+    "random",
+    "randomblob",
+    "changes",
+    "total_changes",
+    "last_insert_rowid",
+    "current_date",
+    "current_time",
+    "current_timestamp",
+    "date",
+    "time",
+    "datetime",
+    "julianday",
+    "unixepoch",
+    "strftime",
+    "timediff"
+};
+
+thread_local bool Statement::calls_volatile_function_ = false;
+
+int Statement::bind_param(const msgpack::object& v, int pos, bool transient) {
+    sqlite3_destructor_type lifetime = transient ? SQLITE_TRANSIENT
+                                                 : SQLITE_STATIC;
     switch (v.type) {
         case msgpack::type::NIL:
             return sqlite3_bind_null(statement_, pos);
@@ -29,26 +59,25 @@ int Statement::bind_param(const msgpack::object& v, int pos) {
             return sqlite3_bind_int64(statement_, pos, v.via.i64);
         case msgpack::type::FLOAT:
             return sqlite3_bind_double(statement_, pos, v.via.f64);
-        case msgpack::type::STR: {
-            std::string value(v.via.str.ptr, v.via.str.size);
+        case msgpack::type::STR:
+            // a null pointer would be bound as NULL instead of an empty string
             return sqlite3_bind_text(statement_,
                                      pos,
-                                     value.data(),
-                                     value.size(),
-                                     SQLITE_TRANSIENT);
-        }
+                                     v.via.str.size ? v.via.str.ptr : "",
+                                     v.via.str.size,
+                                     lifetime);
         case msgpack::type::BIN:
             return sqlite3_bind_blob(statement_,
                                      pos,
                                      v.via.bin.ptr,
                                      v.via.bin.size,
-                                     SQLITE_TRANSIENT);
+                                     lifetime);
         case msgpack::type::EXT:
             return sqlite3_bind_blob(statement_,
                                      pos,
                                      v.via.ext.data(),
                                      v.via.ext.size,
-                                     SQLITE_TRANSIENT);
+                                     lifetime);
         case msgpack::type::MAP:
         case msgpack::type::ARRAY:
             return SQLITE_ERROR;
@@ -56,12 +85,11 @@ int Statement::bind_param(const msgpack::object& v, int pos) {
     return SQLITE_ERROR;
 }
 
-Statement::Statement(sqlite3* db,
-                     const std::string& query,
-                     const msgpack::object_handle& parameters):
-                                                            db_(db),
-                                                            statement_(NULL) {
-    msgpack::object obj(parameters.get());
+Statement::Statement(sqlite3* db, const std::string& query): db_(db),
+                                                              statement_(NULL),
+                                                              rows_(0),
+                                                              bytes_(0) {
+    calls_volatile_function_ = false;
     int ret = sqlite3_prepare_v2(db_,
                                  query.data(),
                                  static_cast<int>(query.size()),
@@ -69,43 +97,121 @@ Statement::Statement(sqlite3* db,
                                  NULL);
     if (ret != SQLITE_OK)
         throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+    deterministic_ = !calls_volatile_function_;
+
+    int param_count = sqlite3_bind_parameter_count(statement_);
+    param_names_.reserve(param_count);
+    for (int i = 0; i < param_count; i++) {
+        const char* name = sqlite3_bind_parameter_name(statement_, i + 1);
+        // nameless `?` parameters can only be bound positionally
+        if (name == NULL)
+            param_names_.push_back(std::string());
+        else
+            param_names_.push_back(std::string(name + 1));  // remove `:` prefix
+    }
+}
 
-    uint64_t param_count = sqlite3_bind_parameter_count(statement_);
-    if (obj.type == msgpack::type::ARRAY) {
-        if (obj.via.array.size != param_count)
+void Statement::bind(const msgpack::object& parameters, bool transient) {
+    uint64_t param_count = param_names_.size();
+    if (parameters.type == msgpack::type::ARRAY) {
+        if (parameters.via.array.size != param_count)
             throw sqlite_error("Parameter binding failed.",
                                "Number of passed parameters does not match "
                                "number of required parameters.");
         for (uint64_t i = 0; i < param_count; i++) {
-            int rc = bind_param(obj.via.array.ptr[i], i + 1);
+            int rc = bind_param(parameters.via.array.ptr[i], i + 1, transient);
             if (rc != SQLITE_OK)
                 throw sqlite_error(sqlite3_errstr(rc), sqlite3_errmsg(db_));
         }
-    } else {
-        std::map<std::string, msgpack::object> unpacked;
-        try {
-            obj.convert(unpacked);
-        } catch (msgpack::type_error& e) {
-            throw sqlite_error("Parameter binding failed.",
-                               "Binding parameters to statement failed. "
-                               "Invalid map.");
-        }
+    } else if (parameters.type == msgpack::type::MAP) {
+        const msgpack::object_kv* begin = parameters.via.map.ptr;
+        const msgpack::object_kv* end = begin + parameters.via.map.size;
         for (uint64_t i = 0; i < param_count; i++) {
-            std::string binding_name(sqlite3_bind_parameter_name(statement_, i + 1));
-            binding_name.erase(0, 1);  // remove first `:` character
-            msgpack::object value;
-            try {
-                value = unpacked.at(binding_name);
-            } catch (std::out_of_range& e) {
+            const std::string& binding_name = param_names_[i];
+            const msgpack::object_kv* kv = begin;
+            for (; kv != end; ++kv) {
+                if (kv->key.type == msgpack::type::STR &&
+                        kv->key.via.str.size == binding_name.size() &&
+                        binding_name.compare(0,
+                                             binding_name.size(),
+                                             kv->key.via.str.ptr,
+                                             kv->key.via.str.size) == 0)
+                    break;
+            }
+            if (binding_name.empty() || kv == end)
                 throw sqlite_error("Parameter binding failed.",
                                    "Binding parameters to statement failed. "
                                    "Missing key: " + binding_name);
-            }
-            int rc = bind_param(value, i + 1);
+            int rc = bind_param(kv->val, i + 1, transient);
             if (rc != SQLITE_OK)
                 throw sqlite_error(sqlite3_errstr(rc), sqlite3_errmsg(db_));
         }
+    } else if (param_count > 0) {
+        throw sqlite_error("Parameter binding failed.",
+                           "Binding parameters to statement failed. "
+                           "Invalid map.");
+    }
+}
+
+void Statement::reset() {
+    sqlite3_reset(statement_);
+    sqlite3_clear_bindings(statement_);
+    rows_ = 0;
+    bytes_ = 0;
+}
+
+sqlite3_stmt* Statement::handle() {
+    return statement_;
+}
+
+uint64_t Statement::rows() {
+    return rows_;
+}
+
+uint64_t Statement::bytes() {
+    return bytes_;
+}
+
+bool Statement::read_only() {
+    // transaction control statements count as read-only for sqlite, but must
+    // run on the connection that holds the transaction. they return no rows,
+    // unlike queries, but so do pragmas changing connection state
+    if (!sqlite3_stmt_readonly(statement_) ||
+            sqlite3_column_count(statement_) == 0)
+        return false;
+    const char* sql = sqlite3_sql(statement_);
+    while (std::isspace(static_cast<unsigned char>(*sql)))
+        ++sql;
+    return sqlite3_strnicmp(sql, "PRAGMA", 6) != 0;
+}
+
+bool Statement::deterministic() {
+    return deterministic_;
+}
+
+StatementTraits Statement::traits() {
+    StatementTraits traits;
+    traits.read_only = read_only();
+    traits.deterministic = deterministic();
+    return traits;
+}
+
+int Statement::authorize(void* /* context */,
+                         int action,
+                         const char* /* first */,
+                         const char* second,
+                         const char* /* database */,
+                         const char* /* trigger */) {
+    // only looks, every statement is allowed
+    if (action != SQLITE_FUNCTION || second == NULL)
+        return SQLITE_OK;
+    for (const char* name : VOLATILE_FUNCTIONS) {
+        if (sqlite3_stricmp(second, name) == 0) {
+            calls_volatile_function_ = true;
+            break;
+        }
     }
+    return SQLITE_OK;
 }
 
 Statement::~Statement() {
@@ -114,10 +220,13 @@ Statement::~Statement() {
 
 void Statement::add_columns_meta_info(Packer* packer) {
     int col_count = sqlite3_column_count(statement_);
-    if (col_count == 0)
+    pack_key(packer, header_keys::COLUMNS);
+    if (col_count == 0) {
+        // statements not returning data still report the key, so the header
+        // map always holds as many entries as it declares
+        packer->pack_nil();
         return;
-
-    packer->pack("columns");
+    }
     packer->pack_array(col_count);
     for (int i = 0; i < col_count; ++i) {
         const char* col_name = sqlite3_column_name(statement_, i);
@@ -129,49 +238,230 @@ void Statement::add_columns_meta_info(Packer* packer) {
     }
 }
 
+void Statement::pack_cell(Packer* packer, int col) {
+    int col_type = sqlite3_column_type(statement_, col);
+    if (col_type == SQLITE_NULL) {
+        packer->pack_nil();
+    } else if (col_type == SQLITE_INTEGER) {
+        packer->pack(sqlite3_column_int64(statement_, col));
+        bytes_ += sizeof(int64_t);
+    } else if (col_type == SQLITE_FLOAT) {
+        packer->pack(sqlite3_column_double(statement_, col));
+        bytes_ += sizeof(double);
+    } else if (col_type == SQLITE_TEXT) {
+        // cell contents are packed straight from sqlite's own copy. the
+        // pointer must be fetched before the size, as fetching it may
+        // still convert the value
+        const unsigned char* text = sqlite3_column_text(statement_, col);
+        uint32_t size = sqlite3_column_bytes(statement_, col);
+        packer->pack_str(size);
+        packer->pack_str_body(reinterpret_cast<const char*>(text), size);
+        bytes_ += size;
+    } else {
+        const void* blob = sqlite3_column_blob(statement_, col);
+        uint32_t size = sqlite3_column_bytes(statement_, col);
+        packer->pack_bin(size);
+        packer->pack_bin_body(static_cast<const char*>(blob), size);
+        bytes_ += size;
+    }
+}
+
 void Statement::fetch_into(Packer* packer) {
     int col_count = sqlite3_data_count(statement_);
     packer->pack_array(col_count);
-    for (int i = 0; i < col_count; ++i) {
+    for (int i = 0; i < col_count; ++i)
+        pack_cell(packer, i);
+    ++rows_;
+}
+
+void Statement::Column::spill(uint64_t rowcount) {
+    // the rows gathered so far are packed as cells, which all later rows
+    // are appended to as well
+    Packer packer(&cells);
+    for (uint64_t row = 0; row < rowcount; ++row) {
+        uint64_t word = le64toh(words[row]);
+        if (nulls[row / 8] & (1 << (row % 8))) {
+            packer.pack_nil();
+        } else if (type == SQLITE_INTEGER) {
+            packer.pack(static_cast<int64_t>(word));
+        } else {
+            double value;
+            std::memcpy(&value, &word, sizeof(value));
+            packer.pack(value);
+        }
+    }
+    words.clear();
+    dense = false;
+}
+
+void Statement::start_columns() {
+    size_t col_count = sqlite3_column_count(statement_);
+    columns_.resize(col_count);
+    for (size_t i = 0; i < col_count; ++i) {
+        std::unique_ptr<Column>& col = columns_[i];
+        if (!col || col->words.capacity() > MAX_RETAINED_COLUMN_ROWS ||
+                col->cells.size() > MAX_RETAINED_COLUMN_ROWS * sizeof(uint64_t))
+            col.reset(new Column());
+        col->type = SQLITE_NULL;
+        col->dense = true;
+        col->has_nulls = false;
+        col->words.clear();
+        col->nulls.clear();
+        col->cells.clear();
+    }
+}
+
+void Statement::gather_row(uint64_t row) {
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        Column& col = *columns_[i];
         int col_type = sqlite3_column_type(statement_, i);
+        if (row % 8 == 0)
+            col.nulls.push_back(0);
         if (col_type == SQLITE_NULL) {
-            packer->pack_nil();
-        } else if (col_type == SQLITE_INTEGER) {
-            packer->pack(sqlite3_column_int64(statement_, i));
+            col.nulls[row / 8] |= 1 << (row % 8);
+            col.has_nulls = true;
+        } else if (col_type != col.type) {
+            // a column stays dense only while its values are numbers of one
+            // and the same type
+            bool numeric = (col_type == SQLITE_INTEGER ||
+                            col_type == SQLITE_FLOAT);
+            if (col.dense && (col.type != SQLITE_NULL || !numeric))
+                col.spill(row);
+            col.type = col_type;
+        }
+        if (!col.dense) {
+            Packer packer(&col.cells);
+            pack_cell(&packer, i);
+            continue;
+        }
+        uint64_t word = 0;
+        if (col_type == SQLITE_INTEGER) {
+            word = static_cast<uint64_t>(sqlite3_column_int64(statement_, i));
         } else if (col_type == SQLITE_FLOAT) {
-            packer->pack(sqlite3_column_double(statement_, i));
-        } else if (col_type == SQLITE_TEXT) {
-            ssize_t size = sqlite3_column_bytes(statement_, i);
-            const unsigned char* text = sqlite3_column_text(statement_, i);
-            packer->pack(std::string(reinterpret_cast<const char*>(text), size));
+            double value = sqlite3_column_double(statement_, i);
+            std::memcpy(&word, &value, sizeof(word));
+        }
+        col.words.push_back(htole64(word));
+        bytes_ += sizeof(word);
+    }
+    ++rows_;
+}
+
+void Statement::pack_columns(Packer* packer, uint64_t rowcount) {
+    // every column is an array of its type, a bitmap of the null cells (the
+    // lowest bit of the first byte stands for the first row) or nil if there
+    // are none, and its values. integer and float columns hold them as a
+    // single bin of little-endian 64 bit words, other ones as an array of
+    // cells, just like rows would
+    packer->pack_array(columns_.size());
+    for (size_t i = 0; i < columns_.size(); ++i) {
+        Column& col = *columns_[i];
+        if (col.dense && col.type == SQLITE_NULL)
+            col.spill(rowcount);  // nothing but nulls
+        packer->pack_array(3);
+        if (!col.dense)
+            pack_key(packer, column_types::ANY);
+        else if (col.type == SQLITE_INTEGER)
+            pack_key(packer, column_types::INT64);
+        else
+            pack_key(packer, column_types::FLOAT64);
+        if (col.has_nulls) {
+            uint32_t size = (rowcount + 7) / 8;
+            packer->pack_bin(size);
+            packer->pack_bin_body(reinterpret_cast<const char*>(col.nulls.data()),
+                                  size);
         } else {
-            ssize_t size = sqlite3_column_bytes(statement_, i);
-            const void* blob = sqlite3_column_blob(statement_, i);
-            const char* data = static_cast<const char*>(blob);
-            packer->pack(std::vector<unsigned char>(data, data + size));
+            packer->pack_nil();
+        }
+        if (col.dense) {
+            uint32_t size = rowcount * sizeof(uint64_t);
+            packer->pack_bin(size);
+            packer->pack_bin_body(reinterpret_cast<const char*>(col.words.data()),
+                                  size);
+        } else {
+            packer->pack_array(rowcount);
+            pack_raw(packer, col.cells.data(), col.cells.size());
         }
     }
 }
 
-uint64_t Statement::execute(Packer* header, Packer* data, bool collect_result) {
+void Statement::step_failed(int ret) {
+    if (ret == SQLITE_INTERRUPT)
+        throw query_interrupted(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+    throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+}
+
+uint64_t Statement::execute(Packer* header,
+                            Packer* data,
+                            bool collect_result,
+                            ResultFormat format) {
     add_columns_meta_info(header);
+    bool columnar = (collect_result && format == COLUMNAR);
+    if (columnar)
+        start_columns();
     uint64_t rowcount = 0;
     while (true) {
         int ret = sqlite3_step(statement_);
         if (ret == SQLITE_DONE) {
-            header->pack("rowcount");
+            if (columnar)
+                pack_columns(data, rowcount);
+            pack_key(header, header_keys::ROWCOUNT);
             if (!sqlite3_stmt_readonly(statement_))
                 rowcount = sqlite3_changes(db_);
             header->pack(rowcount);
             return rowcount;
         } else if (ret == SQLITE_ROW) {
+            if (columnar)
+                gather_row(rowcount);
+            else if (collect_result)
+                fetch_into(data);
             rowcount += 1;
-            if (collect_result)
+        } else {
+            step_failed(ret);
+        }
+    }
+}
+
+uint64_t Statement::execute() {
+    while (true) {
+        int ret = sqlite3_step(statement_);
+        if (ret == SQLITE_DONE) {
+            if (sqlite3_stmt_readonly(statement_))
+                return 0;
+            return sqlite3_changes(db_);
+        } else if (ret != SQLITE_ROW) {
+            step_failed(ret);
+        }
+    }
+}
+
+uint64_t Statement::fetch(Packer* data,
+                          uint64_t count,
+                          bool* done,
+                          ResultFormat format) {
+    bool columnar = (format == COLUMNAR);
+    if (columnar)
+        start_columns();
+    uint64_t rowcount = 0;
+    *done = false;
+    while (rowcount < count) {
+        int ret = sqlite3_step(statement_);
+        if (ret == SQLITE_DONE) {
+            *done = true;
+            break;
+        } else if (ret == SQLITE_ROW) {
+            if (columnar)
+                gather_row(rowcount);
+            else
                 fetch_into(data);
+            rowcount += 1;
         } else {
-            throw sqlite_error(sqlite3_errstr(ret), sqlite3_errmsg(db_));
+            step_failed(ret);
         }
     }
+    if (columnar)
+        pack_columns(data, rowcount);
+    return rowcount;
 }
 
 }  // namespace sqlizator
@@ -9,26 +9,102 @@
 #include <sqlite3.h>
 #include <msgpack.hpp>
 
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "sqlizator/response.h"
 
 namespace sqlizator {
 
+// layout of the rows returned by a query
+enum ResultFormat {
+    ROWS = 1,  // an array of cells per row
+    COLUMNAR = 2  // an array per column, see `Statement::pack_columns`
+};
+
+// what is known about a statement once it is prepared
+struct StatementTraits {
+    bool read_only;  // see Statement::read_only
+    bool deterministic;  // see Statement::deterministic
+};
+
 class Statement {
  private:
+    // cells of one column of a columnar result, gathered until all rows of
+    // the batch are known
+    struct Column {
+        int type;  // of the non-null cells so far, SQLITE_NULL if none
+        // while all cells share an integer or float type they are stored
+        // as little-endian 64 bit words, nulls as zero
+        bool dense;
+        bool has_nulls;
+        std::vector<uint64_t> words;
+        std::vector<uint8_t> nulls;  // bit per row, set if the cell is null
+        msgpack::sbuffer cells;  // packed cells once the column is not dense
+
+        // turns the first `rowcount` dense values into packed cells
+        void spill(uint64_t rowcount);
+    };
+
     sqlite3* db_;
     sqlite3_stmt* statement_;
+    // names of the statement's parameters without their leading prefix
+    // character, resolved once when the statement is prepared
+    std::vector<std::string> param_names_;
+    // rows and their column data returned since the last reset
+    uint64_t rows_;
+    uint64_t bytes_;
+    bool deterministic_;
 
-    int bind_param(const msgpack::object& v, int pos);
-    void add_columns_meta_info(Packer* packer);
+    // set by the authorizer when a statement being prepared on this thread
+    // calls a function whose result may differ from call to call
+    static thread_local bool calls_volatile_function_;
+
+    // reused from batch to batch, so they keep their storage
+    std::vector<std::unique_ptr<Column>> columns_;
+
+    int bind_param(const msgpack::object& v, int pos, bool transient);
+    void pack_cell(Packer* packer, int col);
     void fetch_into(Packer* packer);
+    void start_columns();
+    void gather_row(uint64_t row);
+    void pack_columns(Packer* packer, uint64_t rowcount);
+    // throws the error of a failed step
+    void step_failed(int ret);
  public:
-    explicit Statement(sqlite3* db,
-                       const std::string& query,
-                       const msgpack::object_handle& parameters);
+    explicit Statement(sqlite3* db, const std::string& query);
     ~Statement();
-    uint64_t execute(Packer* header, Packer* data, bool collect_result);
+    // strings and blobs are bound in place and must stay valid until the
+    // statement is reset, unless `transient` has sqlite copy them
+    void bind(const msgpack::object& parameters, bool transient = false);
+    void reset();
+    sqlite3_stmt* handle();
+    uint64_t rows();
+    uint64_t bytes();
+    bool read_only();
+    // false if it calls random(), reads the clock or the state of the
+    // connection, so that its results may differ with the same data
+    bool deterministic();
+    StatementTraits traits();
+    // sqlite authorizer, to be set on every connection statements are
+    // prepared on, so that they can tell whether they are deterministic
+    static int authorize(void* context,
+                         int action,
+                         const char* first,
+                         const char* second,
+                         const char* database,
+                         const char* trigger);
+    void add_columns_meta_info(Packer* packer);
+    uint64_t execute(Packer* header,
+                     Packer* data,
+                     bool collect_result,
+                     ResultFormat format = ROWS);
+    uint64_t execute();
+    uint64_t fetch(Packer* data,
+                   uint64_t count,
+                   bool* done,
+                   ResultFormat format = ROWS);
 };
 
 }  // namespace sqlizator
@@ -0,0 +1,93 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "sqlizator/statement.h"
+#include "sqlizator/statementcache.h"
+
+namespace sqlizator {
+
+StatementCache::StatementCache(size_t capacity): capacity_(capacity),
+                                                 hits_(0),
+                                                 misses_(0),
+                                                 evictions_(0) {}
+
+std::unique_ptr<Statement> StatementCache::acquire(sqlite3* db,
+                                                   const std::string& query) {
+    auto found = slots_.find(query);
+    if (found == slots_.end() || found->second.empty()) {
+        misses_ += 1;
+        return std::unique_ptr<Statement>(new Statement(db, query));
+    }
+    hits_ += 1;
+    EntryList::iterator entry = found->second.back();
+    found->second.pop_back();
+    std::unique_ptr<Statement> stmt(std::move(entry->stmt));
+    parked_.splice(parked_.end(), entries_, entry);
+    return stmt;
+}
+
+void StatementCache::release(const std::string& query,
+                             std::unique_ptr<Statement> stmt) {
+    if (capacity_ == 0)
+        return;  // caching disabled, statement gets finalized
+
+    stmt->reset();
+    auto found = slots_.find(query);
+    if (found == slots_.end())
+        found = slots_.insert(std::make_pair(query, Slot())).first;
+    if (parked_.empty())
+        entries_.emplace_front();
+    else
+        entries_.splice(entries_.begin(), parked_, parked_.begin());
+    Entry& entry = entries_.front();
+    entry.stmt = std::move(stmt);
+    entry.query = &found->first;
+    found->second.push_back(entries_.begin());
+    if (entries_.size() > capacity_)
+        evict(entries_.size() - capacity_);
+}
+
+void StatementCache::evict(size_t count) {
+    for (size_t i = 0; i < count && !entries_.empty(); ++i) {
+        EntryList::iterator last = std::prev(entries_.end());
+        auto found = slots_.find(*last->query);
+        Slot& slot = found->second;
+        slot.erase(std::find(slot.begin(), slot.end(), last));
+        if (slot.empty())
+            slots_.erase(found);
+        entries_.erase(last);
+        evictions_ += 1;
+    }
+}
+
+void StatementCache::resize(size_t capacity) {
+    capacity_ = capacity;
+    if (entries_.size() > capacity_)
+        evict(entries_.size() - capacity_);
+}
+
+void StatementCache::clear() {
+    slots_.clear();
+    entries_.clear();
+    parked_.clear();
+}
+
+CacheStats StatementCache::stats() {
+    CacheStats stats;
+    stats.size = entries_.size();
+    stats.capacity = capacity_;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.evictions = evictions_;
+    return stats;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,67 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_STATEMENTCACHE_H_
+#define SQLIZATOR_SQLIZATOR_STATEMENTCACHE_H_
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sqlizator/statement.h"
+
+namespace sqlizator {
+
+static const size_t DEFAULT_STATEMENT_CACHE_SIZE = 64;
+
+struct CacheStats {
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+// Bounded LRU cache of prepared statements keyed by their SQL text. A
+// statement is taken out of the cache while in use and put back once it
+// was reset, so the same query may be in use more than once at a time.
+// Taking a statement out and putting it back allocates nothing: the list
+// node of a statement in use is parked until the statement returns.
+class StatementCache {
+ private:
+    struct Entry {
+        std::unique_ptr<Statement> stmt;
+        const std::string* query;  // key of the slot the entry belongs to
+    };
+    typedef std::list<Entry> EntryList;
+    // cached statements of the same query text, most recently used last
+    typedef std::vector<EntryList::iterator> Slot;
+    typedef std::unordered_map<std::string, Slot> SlotMap;
+
+    size_t capacity_;
+    EntryList entries_;  // most recently used first
+    EntryList parked_;   // nodes of statements currently in use
+    SlotMap slots_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+
+    void evict(size_t count);
+ public:
+    explicit StatementCache(size_t capacity);
+    std::unique_ptr<Statement> acquire(sqlite3* db, const std::string& query);
+    void release(const std::string& query, std::unique_ptr<Statement> stmt);
+    void resize(size_t capacity);
+    void clear();
+    CacheStats stats();
+};
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_STATEMENTCACHE_H_
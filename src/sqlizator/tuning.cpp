@@ -0,0 +1,155 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "sqlizator/tuning.h"
+
+namespace sqlizator {
+
+struct Tunable {
+    const char* name;
+    bool per_connection;
+    // accepted keywords, besides integers if those are allowed
+    const char* const* keywords;
+    bool integers;
+    int64_t min;
+    int64_t max;
+};
+
+static const char* const NO_KEYWORDS[] = {NULL};
+static const char* const JOURNAL_MODES[] = {"DELETE", "TRUNCATE", "PERSIST",
+                                            "MEMORY", "WAL", "OFF", NULL};
+static const char* const SWITCHES[] = {"ON", "OFF", "TRUE", "FALSE", "YES",
+                                       "NO", NULL};
+static const char* const SYNCHRONOUS_MODES[] = {"OFF", "NORMAL", "FULL",
+                                                "EXTRA", NULL};
+static const char* const TEMP_STORES[] = {"DEFAULT", "FILE", "MEMORY", NULL};
+
+static const int64_t INT_MIN_VALUE = std::numeric_limits<int>::min();
+static const int64_t INT_MAX_VALUE = std::numeric_limits<int>::max();
+
+// in the order they are applied. the page size of a database in WAL mode
+// cannot change anymore, and checkpoints only happen on the writer
+static const Tunable TUNABLES[] = {
+    {"page_size", false, NO_KEYWORDS, true, 512, 65536},
+    {"journal_mode", false, JOURNAL_MODES, false, 0, 0},
+    {"wal_autocheckpoint", false, NO_KEYWORDS, true, 0, INT_MAX_VALUE},
+    {"synchronous", true, SYNCHRONOUS_MODES, true, 0, 3},
+    {"foreign_keys", true, SWITCHES, true, 0, 1},
+    {"cache_size", true, NO_KEYWORDS, true, INT_MIN_VALUE, INT_MAX_VALUE},
+    {"mmap_size", true, NO_KEYWORDS, true, 0,
+     std::numeric_limits<int64_t>::max()},
+    {"temp_store", true, TEMP_STORES, true, 0, 2},
+    {"busy_timeout", true, NO_KEYWORDS, true, 0, INT_MAX_VALUE},
+};
+static const size_t TUNABLE_COUNT = sizeof(TUNABLES) / sizeof(TUNABLES[0]);
+
+// profile name, pragma and value
+static const char* const PROFILES[][3] = {
+    // every commit is synced, so it survives a power loss
+    {"durable", "journal_mode", "WAL"},
+    {"durable", "synchronous", "FULL"},
+    // reads are served from the page cache or a memory mapping of the file,
+    // commits may be lost on a power loss, but never corrupt the database
+    {"read-mostly", "journal_mode", "WAL"},
+    {"read-mostly", "synchronous", "NORMAL"},
+    {"read-mostly", "cache_size", "-32768"},
+    {"read-mostly", "mmap_size", "268435456"},
+    {"read-mostly", "temp_store", "MEMORY"},
+    // nothing is synced and the log grows longer between checkpoints, for
+    // loading data that can be loaded again after a crash
+    {"bulk-ingest", "journal_mode", "WAL"},
+    {"bulk-ingest", "synchronous", "OFF"},
+    {"bulk-ingest", "wal_autocheckpoint", "10000"},
+    {"bulk-ingest", "cache_size", "-65536"},
+    {"bulk-ingest", "temp_store", "MEMORY"},
+};
+static const size_t PROFILE_ROWS = sizeof(PROFILES) / sizeof(PROFILES[0]);
+
+// index of the pragma in TUNABLES, or TUNABLE_COUNT if it is not there
+static size_t tunable_index(const std::string& key) {
+    for (size_t i = 0; i < TUNABLE_COUNT; ++i) {
+        if (key == TUNABLES[i].name)
+            return i;
+    }
+    return TUNABLE_COUNT;
+}
+
+bool tunable(const std::string& key) {
+    return tunable_index(key) < TUNABLE_COUNT;
+}
+
+bool per_connection(const std::string& key) {
+    size_t index = tunable_index(key);
+    return index < TUNABLE_COUNT && TUNABLES[index].per_connection;
+}
+
+std::string checked_pragma(const std::string& key, const std::string& value) {
+    size_t index = tunable_index(key);
+    if (index == TUNABLE_COUNT)
+        throw std::invalid_argument("Unknown pragma " + key + ".");
+    const Tunable& pragma = TUNABLES[index];
+    std::string keyword(value);
+    std::transform(keyword.begin(), keyword.end(), keyword.begin(), ::toupper);
+    for (const char* const* it = pragma.keywords; *it != NULL; ++it) {
+        if (keyword == *it)
+            return keyword;
+    }
+    std::invalid_argument invalid("Invalid value of " + key + ": " + value);
+    if (!pragma.integers || value.empty())
+        throw invalid;
+    for (size_t i = (value[0] == '-') ? 1 : 0; i < value.size(); ++i) {
+        if (!std::isdigit(value[i]))
+            throw invalid;
+    }
+    int64_t number;
+    try {
+        number = std::stoll(value);
+    } catch (std::out_of_range& e) {
+        throw invalid;
+    }
+    if (number < pragma.min || number > pragma.max)
+        throw invalid;
+    // the page size is a power of two
+    if (key == "page_size" && (number & (number - 1)) != 0)
+        throw invalid;
+    return std::to_string(number);
+}
+
+void set_pragma(PragmaList* pragmas,
+                const std::string& key,
+                const std::string& value) {
+    size_t index = tunable_index(key);
+    PragmaList::iterator it = pragmas->begin();
+    for (; it != pragmas->end(); ++it) {
+        if (it->first == key) {
+            it->second = value;
+            return;
+        }
+        if (tunable_index(it->first) > index)
+            break;
+    }
+    pragmas->insert(it, std::make_pair(key, value));
+}
+
+bool tuning_profile(const std::string& name, PragmaList* pragmas) {
+    bool found = false;
+    for (size_t i = 0; i < PROFILE_ROWS; ++i) {
+        if (name == PROFILES[i][0]) {
+            set_pragma(pragmas, PROFILES[i][1], PROFILES[i][2]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+}  // namespace sqlizator
@@ -0,0 +1,35 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef SQLIZATOR_SQLIZATOR_TUNING_H_
+#define SQLIZATOR_SQLIZATOR_TUNING_H_
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sqlizator {
+
+// pragma names and values, in the order they are applied
+typedef std::vector<std::pair<std::string, std::string>> PragmaList;
+
+// whether a pragma may be passed to connect
+bool tunable(const std::string& key);
+// whether a pragma is a setting of each connection, as opposed to one of
+// the database file, which is set through the writer alone
+bool per_connection(const std::string& key);
+// returns the value in the form it is applied in, or throws
+// std::invalid_argument if it is not valid for the pragma. values end up
+// in the text of a statement, so only known keywords and plain integers
+// are let through
+std::string checked_pragma(const std::string& key, const std::string& value);
+// adds or replaces a pragma, keeping the list in the order pragmas have to
+// be applied in, e.g. the page size before the journal mode
+void set_pragma(PragmaList* pragmas,
+                const std::string& key,
+                const std::string& value);
+// adds the pragmas of a named profile, false if there is no such profile
+bool tuning_profile(const std::string& name, PragmaList* pragmas);
+
+}  // namespace sqlizator
+#endif  // SQLIZATOR_SQLIZATOR_TUNING_H_
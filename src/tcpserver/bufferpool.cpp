@@ -0,0 +1,75 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "tcpserver/bufferpool.h"
+#include "tcpserver/heapcounter.h"
+#include "tcpserver/outputqueue.h"
+
+namespace tcpserver {
+
+BufferPool* BufferPool::instance() {
+    // never destroyed, as connections may still return blocks while static
+    // objects are torn down at exit
+    static BufferPool* pool = new BufferPool();
+    return pool;
+}
+
+char* BufferPool::acquire_chunk() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!chunks_.empty()) {
+            char* chunk = chunks_.back();
+            chunks_.pop_back();
+            return chunk;
+        }
+    }
+    count_allocation();
+    char* chunk = static_cast<char*>(std::malloc(CHUNK_SIZE));
+    if (chunk == NULL)
+        throw std::bad_alloc();
+    return chunk;
+}
+
+void BufferPool::release_chunk(char* chunk) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (chunks_.size() < MAX_POOLED_CHUNKS) {
+            chunks_.push_back(chunk);
+            return;
+        }
+    }
+    std::free(chunk);
+}
+
+shared_byte_vec BufferPool::acquire_buffer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = buffers_.size(); i > 0; --i) {
+            if (buffers_[i - 1].unique()) {
+                shared_byte_vec buffer(std::move(buffers_[i - 1]));
+                buffers_[i - 1] = std::move(buffers_.back());
+                buffers_.pop_back();
+                buffer->clear();
+                return buffer;
+            }
+        }
+    }
+    return std::make_shared<byte_vec>();
+}
+
+void BufferPool::release_buffer(shared_byte_vec buffer) {
+    if (!buffer || buffer->capacity() > MAX_POOLED_BUFFER_SIZE)
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffers_.size() < MAX_POOLED_BUFFERS)
+        buffers_.push_back(std::move(buffer));
+}
+
+}  // namespace tcpserver
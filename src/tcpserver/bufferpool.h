@@ -0,0 +1,48 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_BUFFERPOOL_H_
+#define TCPSERVER_TCPSERVER_BUFFERPOOL_H_
+#include <mutex>
+#include <vector>
+
+#include "tcpserver/commontypes.h"
+
+namespace tcpserver {
+
+// the pool holds at most this many blocks of each kind, anything returned
+// beyond that is freed
+static const size_t MAX_POOLED_CHUNKS = 256;
+static const size_t MAX_POOLED_BUFFERS = 64;
+// receive buffers that grew larger than this are freed instead of pooled
+static const size_t MAX_POOLED_BUFFER_SIZE = 1024 * 1024;
+
+// Process wide pool of the memory blocks connections need while they have
+// data in flight: chunks of outgoing data and receive buffers. Connections
+// return them as soon as they are done, so idle ones hold on to nothing and
+// busy ones reuse what others gave back instead of going to the heap.
+class BufferPool {
+ private:
+    std::mutex mutex_;
+    std::vector<char*> chunks_;
+    // receive buffers may be returned while jobs still refer to them, they
+    // are handed out again only once the pool holds the last reference
+    std::vector<shared_byte_vec> buffers_;
+
+    BufferPool() {}
+
+ public:
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    static BufferPool* instance();
+    // a block of CHUNK_SIZE bytes
+    char* acquire_chunk();
+    void release_chunk(char* chunk);
+    // an empty receive buffer
+    shared_byte_vec acquire_buffer();
+    void release_buffer(shared_byte_vec buffer);
+};
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_BUFFERPOOL_H_
@@ -7,24 +7,84 @@
 
 #include <cstring>
 #include <string>
+#include <utility>
 
+#include "tcpserver/bufferpool.h"
 #include "tcpserver/clientsocket.h"
 #include "tcpserver/commontypes.h"
 #include "tcpserver/exceptions.h"
 
 namespace tcpserver {
 
-ClientSocket::ClientSocket(int server_socket_fd): server_socket_fd_(server_socket_fd) {}
+static const size_t RECV_BUFFER_SIZE = 16384;
+
+// a spare receive buffer larger than this goes back to the pool instead of
+// staying with the connection
+static const size_t MAX_SPARE_BUFFER_SIZE = 65536;
+
+ClientSocket::ClientSocket(int server_socket_fd): server_socket_fd_(server_socket_fd),
+                                                  socket_fd_(-1) {}
 
 ClientSocket::~ClientSocket() {
     if (socket_fd_ != -1)
         close(socket_fd_);
+    BufferPool::instance()->release_buffer(std::move(buffer_));
+    BufferPool::instance()->release_buffer(std::move(spare_));
 }
 
 int ClientSocket::fd() {
     return socket_fd_;
 }
 
+shared_byte_vec ClientSocket::buffer() {
+    if (!buffer_)
+        buffer_ = take_spare();
+    return buffer_;
+}
+
+void ClientSocket::consume(size_t consumed) {
+    if (consumed == 0)
+        return;
+    if (consumed == buffer_->size()) {
+        // nothing left over, the buffer is set aside until more data arrives
+        retire(std::move(buffer_));
+        return;
+    }
+    if (buffer_.unique()) {
+        // nothing refers to the consumed bytes, keep the allocation
+        buffer_->erase(buffer_->begin(), buffer_->begin() + consumed);
+        return;
+    }
+    // decoded requests still point into the old buffer, which must stay
+    // unchanged until they are done with it
+    shared_byte_vec rest(take_spare());
+    rest->assign(buffer_->begin() + consumed, buffer_->end());
+    retire(std::move(buffer_));
+    buffer_ = std::move(rest);
+}
+
+shared_byte_vec ClientSocket::take_spare() {
+    if (spare_ && spare_.unique()) {
+        shared_byte_vec buffer(std::move(spare_));
+        buffer->clear();
+        return buffer;
+    }
+    return BufferPool::instance()->acquire_buffer();
+}
+
+void ClientSocket::retire(shared_byte_vec buffer) {
+    if (buffer->capacity() > MAX_SPARE_BUFFER_SIZE) {
+        BufferPool::instance()->release_buffer(std::move(buffer));
+        return;
+    }
+    BufferPool::instance()->release_buffer(std::move(spare_));
+    spare_ = std::move(buffer);
+}
+
+OutputQueue* ClientSocket::output() {
+    return &output_;
+}
+
 int ClientSocket::accept() {
     struct sockaddr in_addr;
     socklen_t in_len = sizeof(in_addr);
@@ -37,9 +97,9 @@ int ClientSocket::accept() {
     return socket_fd_;
 }
 
-ssize_t ClientSocket::recv(byte_vec* into) {
-    while (true) {
-        char buf[512];
+bool ClientSocket::recv(byte_vec* into, size_t limit) {
+    while (into->size() < limit) {
+        char buf[RECV_BUFFER_SIZE];
         ssize_t bytes_read = ::read(socket_fd_, buf, sizeof(buf));
         if (bytes_read == -1) {
             // if EAGAIN, all data is read
@@ -47,32 +107,20 @@ ssize_t ClientSocket::recv(byte_vec* into) {
                 std::string msg(std::strerror(errno));
                 throw socket_error(msg);
             }
-            break;
+            return false;
         } else if (bytes_read == 0) {
             // remote has closed the connection
             throw connection_closed("Remote has closed the connection.");
         }
         into->insert(into->end(), buf, buf + bytes_read);
     }
-    return into->size();
+    return true;
 }
 
-ssize_t ClientSocket::send(const byte_vec& data) {
-    ssize_t data_size = data.size();
-    ssize_t bytes_sent = 0;
-    ssize_t bytes_left = data_size;
-    ssize_t n;
-    while (bytes_sent < data_size) {
-        n = ::send(socket_fd_, &data[bytes_sent], bytes_left, 0);
-        if (n == -1) {
-            std::string msg(std::strerror(errno));
-            throw socket_error(msg);
-        }
-        bytes_sent += n;
-        bytes_left -= n;
-    }
-    return bytes_sent;
+bool ClientSocket::send() {
+    // writes until the kernel buffer is full, the rest stays queued
+    output_.flush(socket_fd_);
+    return output_.empty();
 }
 
 }  // namespace tcpserver
-
@@ -7,6 +7,7 @@
 #include <string>
 
 #include "tcpserver/commontypes.h"
+#include "tcpserver/outputqueue.h"
 
 namespace tcpserver {
 
@@ -14,14 +15,32 @@ class ClientSocket {
  private:
     int server_socket_fd_;
     int socket_fd_;
+    // bytes received but not yet consumed by the request handler, kept
+    // between epoll wakeups so requests may span multiple reads. it is only
+    // allocated while something is buffered
+    shared_byte_vec buffer_;
+    // the previous receive buffer, reused once no job refers to it anymore
+    shared_byte_vec spare_;
+    // replies not yet accepted by the kernel
+    OutputQueue output_;
+
+    shared_byte_vec take_spare();
+    void retire(shared_byte_vec buffer);
 
  public:
     explicit ClientSocket(int server_socket_fd);
     ~ClientSocket();
     int fd();
+    shared_byte_vec buffer();
+    // drops consumed bytes from the start of the buffer
+    void consume(size_t consumed);
+    OutputQueue* output();
     int accept();
-    ssize_t recv(byte_vec* into);
-    ssize_t send(const byte_vec& data);
+    // appends what was received until the input was drained, or `into`
+    // holds at least `limit` bytes, in which case it returns true as more
+    // may be left to read
+    bool recv(byte_vec* into, size_t limit);
+    bool send();
 };
 
 }  // namespace tcpserver
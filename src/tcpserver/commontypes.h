@@ -6,11 +6,56 @@
 #define TCPSERVER_TCPSERVER_COMMONTYPES_H_
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "tcpserver/fifo.h"
+#include "tcpserver/outputqueue.h"
+
 namespace tcpserver {
 
 typedef std::vector<uint8_t> byte_vec;
+// received data, shared with the jobs decoded from it so that they may keep
+// referring to it in place instead of copying out what they need
+typedef std::shared_ptr<byte_vec> shared_byte_vec;
+// a single decoded request, which appends its reply to the passed in queue.
+// jobs dropped along with their connection are called with a null queue
+// instead, so that they can let go of what they hold
+typedef std::function<void(OutputQueue*)> job_fn;
+// identifies a queue of the worker pool, see WorkerPool::add_flow
+typedef uint64_t flow_id;
+// flow of jobs submitted without one, which always exists
+static const flow_id DEFAULT_FLOW = 0;
+
+// a job along with where the worker pool queues it, see WorkerPool
+struct Job {
+    job_fn fn;
+    flow_id flow;
+    bool write;
+
+    Job(): flow(DEFAULT_FLOW), write(false) {}
+    Job(job_fn fn, flow_id flow, bool write): fn(std::move(fn)),
+                                              flow(flow),
+                                              write(write) {}
+};
+
+typedef Fifo<Job> job_queue;
+
+// whatever the request handler keeps about a connection between calls,
+// freed along with the connection
+class ConnectionState {
+ public:
+    virtual ~ConnectionState() {}
+};
+
+typedef std::unique_ptr<ConnectionState> connection_state;
+// decodes requests from the input into jobs, returns the bytes consumed
+typedef std::function<size_t(const shared_byte_vec&,
+                             connection_state*,
+                             job_queue*)> handler_fn;
 
 }  // namespace tcpserver
 #endif  // TCPSERVER_TCPSERVER_COMMONTYPES_H_
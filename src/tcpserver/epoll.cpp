@@ -27,10 +27,10 @@ Epoll::~Epoll() {
         close(epoll_fd_);
 }
 
-void Epoll::add(int fd, epoll_fn fn) {
+void Epoll::add(int fd, epoll_fn fn, uint32_t events) {
     struct epoll_event event;
     event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
+    event.events = events;
     if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) == -1) {
         std::string msg(std::strerror(errno));
         throw epoll_error(msg);
@@ -38,6 +38,16 @@ void Epoll::add(int fd, epoll_fn fn) {
     callbacks_[fd] = fn;
 }
 
+void Epoll::modify(int fd, uint32_t events) {
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = events;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) == -1) {
+        std::string msg(std::strerror(errno));
+        throw epoll_error(msg);
+    }
+}
+
 void Epoll::remove(int fd) {
     if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, 0) == -1) {
         std::string msg(std::strerror(errno));
@@ -53,17 +63,13 @@ void Epoll::wait() {
         throw epoll_error(msg);
     }
     for (int i = 0; i < fds_ready; i++) {
-        if ((events_[i].events & EPOLLERR) ||
-                (events_[i].events & EPOLLHUP) ||
-                (!(events_[i].events & EPOLLIN))) {
-            close(events_[i].data.fd);
-            continue;
-        }
+        // errors and hangups are passed on as well, the owner of the file
+        // descriptor notices them on its next read or write and cleans up
         auto found = callbacks_.find(events_[i].data.fd);
-        if (found != callbacks_.end()) {
-            epoll_fn fn = found->second;
-            fn(events_[i].data.fd);
-        }
+        // called in place rather than copied, a callback only ever adds
+        // descriptors other than its own while it runs
+        if (found != callbacks_.end())
+            found->second(events_[i].data.fd, events_[i].events);
     }
 }
 
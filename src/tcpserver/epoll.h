@@ -4,6 +4,7 @@
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
 #ifndef TCPSERVER_TCPSERVER_EPOLL_H_
 #define TCPSERVER_TCPSERVER_EPOLL_H_
+#include <stdint.h>
 #include <sys/epoll.h>
 
 #include <functional>
@@ -12,7 +13,8 @@
 
 namespace tcpserver {
 
-typedef std::function<void(int)> epoll_fn;
+// called with the ready file descriptor and the events that occurred on it
+typedef std::function<void(int, uint32_t)> epoll_fn;
 
 static const int MAX_EVENTS = 64;
 
@@ -25,7 +27,8 @@ class Epoll {
  public:
     Epoll();
     ~Epoll();
-    void add(int fd, epoll_fn fn);
+    void add(int fd, epoll_fn fn, uint32_t events = EPOLLIN | EPOLLET);
+    void modify(int fd, uint32_t events);
     void remove(int fd);
     void wait();
 };
@@ -21,6 +21,12 @@ class connection_closed: public std::runtime_error {
                                                 std::runtime_error(message) {}
 };
 
+class protocol_error: public std::runtime_error {
+ public:
+    explicit protocol_error(const std::string& message):
+                                                std::runtime_error(message) {}
+};
+
 class epoll_error: public std::runtime_error {
  public:
     explicit epoll_error(const std::string& message):
@@ -0,0 +1,65 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_FIFO_H_
+#define TCPSERVER_TCPSERVER_FIFO_H_
+#include <utility>
+#include <vector>
+
+namespace tcpserver {
+
+// storage above this many items is given back once the queue drains
+static const size_t FIFO_RETAINED_ITEMS = 256;
+
+// First in, first out queue over a vector. Unlike a deque, which allocates
+// and frees a block every few items passing through it, it keeps its
+// storage between uses, so a steady flow of items does not allocate.
+template<typename T>
+class Fifo {
+ private:
+    std::vector<T> items_;
+    size_t head_;  // index of the front item
+
+ public:
+    Fifo(): head_(0) {}
+
+    void push_back(T&& item) {
+        items_.push_back(std::move(item));
+    }
+
+    void push_back(const T& item) {
+        items_.push_back(item);
+    }
+
+    T& front() {
+        return items_[head_];
+    }
+
+    void pop_front() {
+        // whatever the item holds is released right away
+        items_[head_] = T();
+        ++head_;
+        if (head_ == items_.size()) {
+            items_.clear();
+            head_ = 0;
+            if (items_.capacity() > FIFO_RETAINED_ITEMS)
+                std::vector<T>().swap(items_);
+        } else if (head_ >= FIFO_RETAINED_ITEMS && head_ * 2 >= items_.size()) {
+            // never drained while busy, so move the live items to the start
+            items_.erase(items_.begin(), items_.begin() + head_);
+            head_ = 0;
+        }
+    }
+
+    bool empty() const {
+        return head_ == items_.size();
+    }
+
+    size_t size() const {
+        return items_.size() - head_;
+    }
+};
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_FIFO_H_
@@ -0,0 +1,83 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+//
+// Replaces the global allocation functions with ones that count how often
+// they are called, so that allocations on the request path show up in the
+// server stats. Memory itself still comes from malloc. Without
+// COUNT_HEAP_ALLOCATIONS the default ones are left in place.
+#include <stdint.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "tcpserver/heapcounter.h"
+
+namespace tcpserver {
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+
+static std::atomic<uint64_t> allocations(0);
+
+uint64_t heap_allocations() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void count_allocation() {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+#else
+
+uint64_t heap_allocations() {
+    return 0;
+}
+
+void count_allocation() {}
+
+#endif  // COUNT_HEAP_ALLOCATIONS
+
+}  // namespace tcpserver
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+
+void* operator new(size_t size) {
+    tcpserver::count_allocation();
+    void* p = std::malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    tcpserver::count_allocation();
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    std::free(p);
+}
+
+#endif  // COUNT_HEAP_ALLOCATIONS
@@ -0,0 +1,27 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_HEAPCOUNTER_H_
+#define TCPSERVER_TCPSERVER_HEAPCOUNTER_H_
+#include <stdint.h>
+
+namespace tcpserver {
+
+// allocations are only counted by builds with COUNT_HEAP_ALLOCATIONS defined,
+// see the Makefile, as that makes every allocation of the process update a
+// counter shared by all threads
+#ifdef COUNT_HEAP_ALLOCATIONS
+static const bool HEAP_ALLOCATIONS_COUNTED = true;
+#else
+static const bool HEAP_ALLOCATIONS_COUNTED = false;
+#endif
+
+// number of heap allocations made since the process started, through
+// operator new as well as by code calling malloc that counts itself
+uint64_t heap_allocations();
+// for allocations made with malloc directly
+void count_allocation();
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_HEAPCOUNTER_H_
@@ -0,0 +1,161 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "tcpserver/bufferpool.h"
+#include "tcpserver/exceptions.h"
+#include "tcpserver/outputqueue.h"
+
+namespace tcpserver {
+
+// chunks are only kept for this many pending blocks once the queue drained
+static const size_t RETAINED_CHUNK_SLOTS = 16;
+
+void ChunkDeleter::operator()(char* p) const {
+    if (pooled)
+        BufferPool::instance()->release_chunk(p);
+    else
+        std::free(p);
+}
+
+OutputQueue::OutputQueue(): head_(0), offset_(0), size_(0) {}
+
+void OutputQueue::write(const char* data, size_t size) {
+    while (size > 0) {
+        // handed over blocks have no capacity, so they are never written to
+        if (chunks_.size() == head_ ||
+                chunks_.back().size >= chunks_.back().capacity) {
+            char* block = BufferPool::instance()->acquire_chunk();
+            ChunkDeleter deleter = {true};
+            Chunk chunk = {chunk_ptr(block, deleter), 0, CHUNK_SIZE};
+            chunks_.push_back(std::move(chunk));
+        }
+        Chunk& tail = chunks_.back();
+        size_t count = std::min(size, tail.capacity - tail.size);
+        std::memcpy(tail.data.get() + tail.size, data, count);
+        tail.size += count;
+        size_ += count;
+        data += count;
+        size -= count;
+    }
+}
+
+void OutputQueue::push(char* data, size_t size) {
+    if (size < COALESCE_LIMIT) {
+        write(data, size);
+        std::free(data);
+        return;
+    }
+    ChunkDeleter deleter = {false};
+    Chunk chunk = {chunk_ptr(data, deleter), size, 0};
+    chunks_.push_back(std::move(chunk));
+    size_ += size;
+}
+
+void OutputQueue::append(OutputQueue* other) {
+    auto begin = other->chunks_.begin() + other->head_;
+    for (auto it = begin; it != other->chunks_.end(); ++it) {
+        if (it == begin && other->offset_ > 0) {
+            write(it->data.get() + other->offset_, it->size - other->offset_);
+        } else if (it->size < COALESCE_LIMIT) {
+            write(it->data.get(), it->size);
+        } else {
+            size_ += it->size;
+            chunks_.push_back(std::move(*it));
+        }
+    }
+    other->chunks_.clear();
+    other->head_ = 0;
+    other->offset_ = 0;
+    other->size_ = 0;
+}
+
+void OutputQueue::clear() {
+    chunks_.clear();
+    head_ = 0;
+    offset_ = 0;
+    size_ = 0;
+}
+
+void OutputQueue::pop_front() {
+    // the block goes back right away, but the slot is kept until the queue
+    // drains, so that the list itself does not allocate either
+    chunks_[head_].data.reset();
+    ++head_;
+    if (head_ == chunks_.size()) {
+        chunks_.clear();
+        head_ = 0;
+        if (chunks_.capacity() > RETAINED_CHUNK_SLOTS)
+            std::vector<Chunk>().swap(chunks_);
+    } else if (head_ >= RETAINED_CHUNK_SLOTS && head_ * 2 >= chunks_.size()) {
+        // never drained while busy, so move the pending chunks to the start
+        chunks_.erase(chunks_.begin(), chunks_.begin() + head_);
+        head_ = 0;
+    }
+}
+
+size_t OutputQueue::flush(int fd) {
+    size_t sent = 0;
+    while (head_ < chunks_.size()) {
+        struct iovec iov[IOV_MAX];
+        int count = 0;
+        for (auto it = chunks_.begin() + head_;
+                it != chunks_.end() && count < IOV_MAX;
+                ++it, ++count) {
+            size_t skip = (count == 0) ? offset_ : 0;
+            iov[count].iov_base = it->data.get() + skip;
+            iov[count].iov_len = it->size - skip;
+        }
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        // a peer that went away must not kill the process with SIGPIPE
+        ssize_t n = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;  // kernel buffer is full
+            if (errno == EINTR)
+                continue;
+            std::string error(std::strerror(errno));
+            throw socket_error(error);
+        }
+        sent += n;
+        size_ -= n;
+        // drop the chunks that were sent completely
+        size_t left = n;
+        while (left > 0) {
+            Chunk& front = chunks_[head_];
+            size_t remaining = front.size - offset_;
+            if (left < remaining) {
+                offset_ += left;
+                break;
+            }
+            left -= remaining;
+            offset_ = 0;
+            pop_front();
+        }
+    }
+    return sent;
+}
+
+size_t OutputQueue::size() {
+    return size_;
+}
+
+bool OutputQueue::empty() {
+    return size_ == 0;
+}
+
+}  // namespace tcpserver
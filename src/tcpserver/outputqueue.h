@@ -0,0 +1,68 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_OUTPUTQUEUE_H_
+#define TCPSERVER_TCPSERVER_OUTPUTQUEUE_H_
+#include <stdint.h>
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace tcpserver {
+
+// blocks smaller than this are copied into a shared chunk, as queueing them
+// on their own would cost more than the copy
+static const size_t COALESCE_LIMIT = 4096;
+static const size_t CHUNK_SIZE = 16384;
+
+// frees handed over blocks, and gives chunks back to the buffer pool
+struct ChunkDeleter {
+    bool pooled;
+
+    void operator()(char* p) const;
+};
+
+typedef std::unique_ptr<char, ChunkDeleter> chunk_ptr;
+
+struct Chunk {
+    chunk_ptr data;
+    size_t size;
+    size_t capacity;  // zero for handed over blocks that must not grow
+};
+
+// Outgoing data of a connection as a list of blocks, written out with a
+// single gathering send instead of being concatenated first. Blocks it
+// copies data into are taken from the buffer pool and returned once sent.
+class OutputQueue {
+ private:
+    std::vector<Chunk> chunks_;
+    size_t head_;    // index of the first chunk not sent completely
+    size_t offset_;  // bytes of the head chunk already sent
+    size_t size_;    // bytes not yet sent
+
+    void pop_front();
+
+ public:
+    OutputQueue();
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue(OutputQueue&&) = default;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+    OutputQueue& operator=(OutputQueue&&) = default;
+    // copies the passed in data
+    void write(const char* data, size_t size);
+    // takes ownership of a block allocated with malloc
+    void push(char* data, size_t size);
+    // moves all pending data of `other` to the end of this queue
+    void append(OutputQueue* other);
+    // discards all pending data
+    void clear();
+    // writes as much as the socket accepts, returns the number of bytes sent
+    size_t flush(int fd);
+    size_t size();
+    bool empty();
+};
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_OUTPUTQUEUE_H_
@@ -0,0 +1,376 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tcpserver/exceptions.h"
+#include "tcpserver/reactor.h"
+
+namespace tcpserver {
+
+Reactor::Reactor(const std::vector<ServerSocket*>& sockets,
+                 WorkerPool* workers,
+                 ServerStats* stats,
+                 handler_fn handler): sockets_(sockets),
+                                      epoll_(),
+                                      next_serial_(0),
+                                      workers_(workers),
+                                      stats_(stats),
+                                      handler_(handler),
+                                      running_(false) {
+    notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd_ == -1) {
+        std::string msg(std::strerror(errno));
+        throw server_error(msg);
+    }
+}
+
+Reactor::~Reactor() {
+    // TODO: close all open connections
+    close(notify_fd_);
+    for (auto it = idle_tasks_.begin(); it != idle_tasks_.end(); ++it)
+        delete *it;
+    for (auto it = completed_.begin(); it != completed_.end(); ++it)
+        delete *it;
+}
+
+void Reactor::listen() {
+    try {
+        for (auto it = sockets_.begin(); it != sockets_.end(); ++it) {
+            uint32_t events = EPOLLIN | EPOLLET;
+#ifdef EPOLLEXCLUSIVE
+            // unix domain sockets are shared by all reactors, of which only
+            // one needs to be woken up to accept a connection
+            if ((*it)->transport() == UNIX_DOMAIN)
+                events |= EPOLLEXCLUSIVE;
+#endif
+            epoll_.add((*it)->fd(),
+                       std::bind(&Reactor::accept_connection,
+                                 this,
+                                 std::placeholders::_1,
+                                 std::placeholders::_2),
+                       events);
+        }
+        epoll_.add(notify_fd_, std::bind(&Reactor::collect_completed,
+                                         this,
+                                         std::placeholders::_1,
+                                         std::placeholders::_2));
+    } catch (epoll_error& e) {
+        // TODO: log error
+        throw server_error(e.what());
+    }
+    running_ = true;
+}
+
+void Reactor::run() {
+    while (running_) {
+        try {
+            epoll_.wait();
+        } catch (epoll_error& e) {
+            throw server_error(e.what());
+        }
+    }
+}
+
+void Reactor::stop() {
+    running_ = false;
+    wakeup();
+}
+
+void Reactor::wakeup() {
+    uint64_t one = 1;
+    ssize_t ret = write(notify_fd_, &one, sizeof(one));
+    (void)ret;  // fails only if the counter would overflow
+}
+
+void Reactor::accept_connection(int fd, uint32_t /* events */) {
+    while (true) {
+        std::unique_ptr<ClientSocket> p_clientsocket(new ClientSocket(fd));
+        int in_fd;
+        try {
+            in_fd = p_clientsocket->accept();
+        } catch (socket_error& e) {
+            // TODO: log error
+            continue;
+        }
+        if (in_fd == -1)
+            break;
+
+        Connection& conn = clients_[in_fd];
+        conn.socket = std::move(p_clientsocket);
+        conn.serial = next_serial_++;
+        conn.state.reset();
+        conn.busy = false;
+        conn.closing = false;
+        conn.writing = false;
+        conn.throttled = false;
+        increment(&stats_->connections);
+        increment(&stats_->accepted);
+        try {
+            epoll_.add(in_fd, std::bind(&Reactor::client_event,
+                                        this,
+                                        std::placeholders::_1,
+                                        std::placeholders::_2));
+        } catch (epoll_error& e) {
+            // TODO: log error
+            disconnect(in_fd);
+        }
+    }
+}
+
+void Reactor::client_event(int fd, uint32_t events) {
+    auto found = clients_.find(fd);
+    if (found == clients_.end()) {
+        // TODO: log invalid client
+        return;
+    }
+    if (events & EPOLLERR) {
+        // TODO: log error
+        disconnect(fd);
+        return;
+    }
+    Connection* conn = &found->second;
+    if (events & EPOLLOUT) {
+        if (!flush_output(fd, conn))
+            return;
+        if (!(events & (EPOLLIN | EPOLLHUP))) {
+            if (!close_if_done(fd, conn))
+                resume(fd, conn);
+            return;
+        }
+    }
+    receive_data(fd);
+}
+
+void Reactor::receive_data(int fd) {
+    auto found = clients_.find(fd);
+    if (found == clients_.end())
+        return;
+
+    Connection* conn = &found->second;
+    if (conn->closing) {
+        close_if_done(fd, conn);
+        return;
+    }
+    // read a limited amount at a time, decoding what was read in between,
+    // until nothing is left in the kernel buffer
+    bool more = true;
+    while (more && !conn->closing) {
+        if (throttled(conn)) {
+            // leave the data in the kernel buffer, which makes the remote
+            // block once its own send buffer is full as well
+            conn->throttled = true;
+            break;
+        }
+        // socket found, append incoming data to what is left of earlier reads
+        byte_vec* input = conn->socket->buffer().get();
+        size_t buffered = input->size();
+        try {
+            more = conn->socket->recv(input, buffered + MAX_READ_SIZE);
+        } catch (socket_error& e) {
+            // TODO: log error
+            // deleting the object will close the socket which will
+            // automatically make epoll stop monitoring it as well
+            disconnect(fd);
+            return;
+        } catch (connection_closed& e) {
+            // close socket, but still process the received data before
+            conn->closing = true;
+        }
+        increment(&stats_->bytes_received, input->size() - buffered);
+        // decode all complete requests into jobs of this connection
+        size_t consumed = 0;
+        size_t queued = conn->jobs.size();
+        try {
+            consumed = handler_(conn->socket->buffer(),
+                                &conn->state,
+                                &conn->jobs);
+            if (input->size() - consumed >= MAX_REQUEST_SIZE)
+                throw protocol_error("Request too large.");
+        } catch (protocol_error& e) {
+            // TODO: log error
+            // the stream cannot be resynchronized after malformed input, but
+            // replies to requests preceding it are still delivered
+            conn->closing = true;
+            consumed = input->size();
+        }
+        conn->socket->consume(consumed);
+        increment(&stats_->requests, conn->jobs.size() - queued);
+        increment(&stats_->pending_requests, conn->jobs.size() - queued);
+    }
+    run_jobs(fd, conn);
+}
+
+void Reactor::run_jobs(int fd, Connection* conn) {
+    if (workers_->size() == 0) {
+        // no worker threads, execute all jobs on the reactor thread
+        OutputQueue* output = conn->socket->output();
+        while (!conn->jobs.empty()) {
+            conn->jobs.front().fn(output);
+            conn->jobs.pop_front();
+            decrement(&stats_->pending_requests);
+        }
+        if ((output->empty() || flush_output(fd, conn)) &&
+                !close_if_done(fd, conn))
+            resume(fd, conn);
+        return;
+    }
+    if (!conn->busy && !conn->jobs.empty()) {
+        // a connection has at most one job executing at any time
+        conn->busy = true;
+        Task* task;
+        if (idle_tasks_.empty()) {
+            task = new Task();
+        } else {
+            task = idle_tasks_.back();
+            idle_tasks_.pop_back();
+        }
+        task->fd = fd;
+        task->serial = conn->serial;
+        Job& job = conn->jobs.front();
+        task->job = std::move(job.fn);
+        workers_->submit([this, task]() {
+            run_task(task);
+        }, job.flow, job.write);
+        conn->jobs.pop_front();
+        decrement(&stats_->pending_requests);
+    }
+    if (!close_if_done(fd, conn))
+        resume(fd, conn);
+}
+
+void Reactor::run_task(Task* task) {
+    task->job(&task->output);
+    task->job = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(completed_mutex_);
+        completed_.push_back(task);
+    }
+    wakeup();
+}
+
+void Reactor::collect_completed(int fd, uint32_t /* events */) {
+    // reset the eventfd counter before taking the completed jobs, so that any
+    // job finishing in between triggers another wakeup
+    uint64_t count;
+    ssize_t ret = read(fd, &count, sizeof(count));
+    (void)ret;  // EAGAIN only means there was nothing to reset
+    {
+        std::lock_guard<std::mutex> lock(completed_mutex_);
+        collected_.swap(completed_);
+    }
+    for (auto it = collected_.begin(); it != collected_.end(); ++it) {
+        Task* task = *it;
+        auto found = clients_.find(task->fd);
+        // drop replies to connections that were closed in the meantime
+        if (found == clients_.end() || found->second.serial != task->serial) {
+            recycle(task);
+            continue;
+        }
+        Connection* conn = &found->second;
+        conn->busy = false;
+        bool sent = send_output(task->fd, conn, &task->output);
+        int task_fd = task->fd;
+        recycle(task);
+        if (sent)
+            run_jobs(task_fd, conn);
+    }
+    collected_.clear();
+}
+
+void Reactor::recycle(Task* task) {
+    task->output.clear();
+    if (idle_tasks_.size() < MAX_IDLE_TASKS)
+        idle_tasks_.push_back(task);
+    else
+        delete task;
+}
+
+bool Reactor::send_output(int fd, Connection* conn, OutputQueue* output) {
+    if (output->empty())
+        return true;
+    conn->socket->output()->append(output);
+    return flush_output(fd, conn);
+}
+
+bool Reactor::flush_output(int fd, Connection* conn) {
+    // sending is still possible if the remote has only shut down its
+    // writing side
+    bool flushed;
+    OutputQueue* output = conn->socket->output();
+    size_t pending = output->size();
+    try {
+        flushed = conn->socket->send();
+        increment(&stats_->bytes_sent, pending - output->size());
+        // wait for the socket to become writable only while something is
+        // left over, so that idle connections cause no extra wakeups
+        if (flushed == conn->writing) {
+            uint32_t events = EPOLLIN | EPOLLET;
+            if (!flushed)
+                events |= EPOLLOUT;
+            epoll_.modify(fd, events);
+            conn->writing = !flushed;
+        }
+    } catch (socket_error& e) {
+        // TODO: log error
+        disconnect(fd);
+        return false;
+    } catch (epoll_error& e) {
+        // TODO: log error
+        disconnect(fd);
+        return false;
+    }
+    return true;
+}
+
+bool Reactor::throttled(Connection* conn) {
+    return (conn->socket->output()->size() >= MAX_OUTPUT_BACKLOG ||
+            conn->jobs.size() >= MAX_PENDING_JOBS);
+}
+
+void Reactor::resume(int fd, Connection* conn) {
+    // data that arrived while reading was paused raised no new edge, so it
+    // has to be picked up explicitly
+    if (conn->throttled && !throttled(conn)) {
+        conn->throttled = false;
+        receive_data(fd);
+    }
+}
+
+void Reactor::disconnect(int fd) {
+    // jobs that never started are dropped along with the connection
+    auto found = clients_.find(fd);
+    job_queue* jobs = &found->second.jobs;
+    decrement(&stats_->pending_requests, jobs->size());
+    while (!jobs->empty()) {
+        jobs->front().fn(NULL);
+        jobs->pop_front();
+    }
+    decrement(&stats_->connections);
+    clients_.erase(found);
+}
+
+bool Reactor::close_if_done(int fd, Connection* conn) {
+    if (conn->closing &&
+            !conn->busy &&
+            conn->jobs.empty() &&
+            conn->socket->output()->empty()) {
+        disconnect(fd);
+        return true;
+    }
+    return false;
+}
+
+}  // namespace tcpserver
@@ -0,0 +1,120 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_REACTOR_H_
+#define TCPSERVER_TCPSERVER_REACTOR_H_
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tcpserver/clientsocket.h"
+#include "tcpserver/commontypes.h"
+#include "tcpserver/epoll.h"
+#include "tcpserver/serversocket.h"
+#include "tcpserver/serverstats.h"
+#include "tcpserver/workerpool.h"
+
+namespace tcpserver {
+
+// reading from a connection is paused while more than this many bytes of
+// replies are waiting to be sent, or this many requests wait to be executed,
+// so that a client not reading its replies cannot exhaust the memory
+static const size_t MAX_OUTPUT_BACKLOG = 4 * 1024 * 1024;
+static const size_t MAX_PENDING_JOBS = 1024;
+// no more than this many bytes of a connection are buffered, a request that
+// does not fit is a protocol error, on which the connection is closed
+static const size_t MAX_REQUEST_SIZE = 64 * 1024 * 1024;
+// bytes read from a connection at a time, before decoding what was read
+static const size_t MAX_READ_SIZE = 1024 * 1024;
+
+struct Connection {
+    std::unique_ptr<ClientSocket> socket;
+    // tells apart connections that were assigned the same file descriptor
+    uint64_t serial;
+    // kept by the request handler
+    connection_state state;
+    // decoded requests waiting for the previous one of this connection to
+    // finish, so that replies are always sent in request order
+    job_queue jobs;
+    bool busy;
+    // no more data will be read, close once all pending jobs are done
+    bool closing;
+    // waiting for the socket to become writable again
+    bool writing;
+    // reading was paused, resume once the backlog is processed
+    bool throttled;
+};
+
+typedef std::map<int, Connection> conn_map;
+
+// finished tasks are kept for reuse up to this many
+static const size_t MAX_IDLE_TASKS = 64;
+
+// job handed to a worker thread, which hands it back to the reactor thread
+// along with its reply. tasks are recycled, so that submitting one
+// allocates nothing once the reactor has seen enough of them
+struct Task {
+    int fd;
+    uint64_t serial;
+    job_fn job;
+    OutputQueue output;
+};
+
+// Event loop accepting connections on its listening sockets and owning
+// all connections it accepted.
+// Requests are decoded with the passed in handler and executed on the shared
+// worker pool, while all socket I/O stays on the thread running the loop.
+class Reactor {
+ private:
+    // owned by the server, they may be shared with other reactors
+    std::vector<ServerSocket*> sockets_;
+    Epoll epoll_;
+    conn_map clients_;
+    uint64_t next_serial_;
+    WorkerPool* workers_;
+    ServerStats* stats_;
+    handler_fn handler_;
+    std::atomic<bool> running_;
+    // eventfd through which workers wake up the event loop
+    int notify_fd_;
+    std::mutex completed_mutex_;
+    std::vector<Task*> completed_;
+    // the following are only used by the thread running the loop
+    std::vector<Task*> collected_;
+    std::vector<Task*> idle_tasks_;
+
+    void accept_connection(int fd, uint32_t events);
+    void client_event(int fd, uint32_t events);
+    void receive_data(int fd);
+    void run_jobs(int fd, Connection* conn);
+    void run_task(Task* task);
+    void collect_completed(int fd, uint32_t events);
+    void recycle(Task* task);
+    bool send_output(int fd, Connection* conn, OutputQueue* output);
+    bool flush_output(int fd, Connection* conn);
+    bool throttled(Connection* conn);
+    void resume(int fd, Connection* conn);
+    bool close_if_done(int fd, Connection* conn);
+    void disconnect(int fd);
+    void wakeup();
+
+ public:
+    Reactor(const std::vector<ServerSocket*>& sockets,
+            WorkerPool* workers,
+            ServerStats* stats,
+            handler_fn handler);
+    ~Reactor();
+    // starts watching the listening sockets, which must be bound already
+    void listen();
+    void run();
+    void stop();
+};
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_REACTOR_H_
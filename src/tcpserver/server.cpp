@@ -2,12 +2,9 @@
 // Some rights reserved.
 // This software is free software licensed under the terms of GPLv3. See COPYING
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
-#include <sys/socket.h>
-#include <unistd.h>
-
-#include <cstring>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "tcpserver/exceptions.h"
@@ -15,95 +12,84 @@
 
 namespace tcpserver {
 
-Server::Server(const std::string& port): socket_(port),
-                                         epoll_() {}
+Server::Server(const std::string& port,
+               const std::string& unix_path,
+               size_t workers,
+               size_t reactors): port_(port),
+                                 unix_path_(unix_path),
+                                 reactor_count_(reactors > 0 ? reactors : 1),
+                                 workers_(workers) {}
 
 Server::~Server() {
     // TODO: close all open connections
+    for (auto it = reactors_.begin(); it != reactors_.end(); ++it)
+        (*it)->stop();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+    workers_.stop();
 }
 
 void Server::start() {
-    try {
-        socket_.bind();
-        socket_.listen();
-    } catch (socket_error& e) {
-        throw server_error(e.what());
+    handler_fn handler = std::bind(&Server::handle,
+                                   this,
+                                   std::placeholders::_1,
+                                   std::placeholders::_2,
+                                   std::placeholders::_3);
+    // all sockets are bound before any thread runs, so errors are reported
+    // right away
+    std::vector<ServerSocket*> tcp_sockets;
+    ServerSocket* unix_socket = NULL;
+    if (!port_.empty()) {
+        bool reuse_port = reactor_count_ > 1;
+        for (size_t i = 0; i < reactor_count_; ++i)
+            tcp_sockets.push_back(open_socket(TCP, port_, reuse_port));
+    }
+    if (!unix_path_.empty())
+        unix_socket = open_socket(UNIX_DOMAIN, unix_path_, false);
+    if (tcp_sockets.empty() && unix_socket == NULL)
+        throw server_error("No port or unix socket path to listen on.");
+    for (size_t i = 0; i < reactor_count_; ++i) {
+        std::vector<ServerSocket*> sockets;
+        if (!tcp_sockets.empty())
+            sockets.push_back(tcp_sockets[i]);
+        if (unix_socket != NULL)
+            sockets.push_back(unix_socket);
+        std::unique_ptr<Reactor> reactor(new Reactor(sockets,
+                                                     &workers_,
+                                                     &stats_,
+                                                     handler));
+        reactor->listen();
+        reactors_.push_back(std::move(reactor));
     }
+    workers_.start();
+    // the calling thread runs the first event loop itself
+    for (size_t i = 1; i < reactors_.size(); ++i)
+        threads_.push_back(std::thread(&Reactor::run, reactors_[i].get()));
+    reactors_[0]->run();
+}
+
+ServerSocket* Server::open_socket(Transport transport,
+                                  const std::string& address,
+                                  bool reuse_port) {
+    std::unique_ptr<ServerSocket> socket(new ServerSocket(transport,
+                                                          address,
+                                                          reuse_port));
     try {
-        epoll_.add(socket_.fd(), std::bind(&Server::accept_connection,
-                                           this,
-                                           std::placeholders::_1));
-    } catch (epoll_error& e) {
-        // TODO: log error
+        socket->bind();
+        socket->listen();
+    } catch (socket_error& e) {
         throw server_error(e.what());
     }
-    while (true) {
-        try {
-            epoll_.wait();
-        } catch (epoll_error& e) {
-            throw server_error(e.what());
-        }
-    }
+    sockets_.push_back(std::move(socket));
+    return sockets_.back().get();
 }
 
-void Server::accept_connection(int fd) {
-    while (true) {
-        std::unique_ptr<ClientSocket> p_clientsocket(new ClientSocket(fd));
-        int in_fd;
-        try {
-            in_fd = p_clientsocket->accept();
-        } catch (socket_error& e) {
-            // TODO: log error
-            continue;
-        }
-        if (in_fd == -1)
-            break;
-
-        clients_.insert(std::make_pair(in_fd, std::move(p_clientsocket)));
-        try {
-            epoll_.add(in_fd, std::bind(&Server::receive_data,
-                                        this,
-                                        std::placeholders::_1));
-        } catch (epoll_error& e) {
-            // TODO: log error
-            clients_.erase(in_fd);
-        }
-    }
+ServerStats* Server::stats() {
+    return &stats_;
 }
 
-void Server::receive_data(int fd) {
-    ClientSocket* p_clientsocket;
-    try {
-        p_clientsocket = clients_.at(fd).get();
-    } catch (std::out_of_range& e) {
-        // TODO: log invalid client
-        return;
-    }
-    // socket found, read incoming data into input buffer
-    byte_vec input;
-    try {
-        p_clientsocket->recv(&input);
-    } catch (socket_error& e) {
-        // TODO: log error
-        // deleting the object will close the socket which will automatically
-        // make epoll stop monitoring it as well
-        clients_.erase(fd);
-        return;
-    } catch (connection_closed& e) {
-        // delete socket, but still process the received data after
-        clients_.erase(fd);
-        return;
-    }
-    // process freshly read incoming data and write response into output buffer
-    byte_vec output;
-    handle(input, &output);
-    // send response from output buffer back to client
-    try {
-        p_clientsocket->send(output);
-    } catch (socket_error& e) {
-        // TODO: log error
-        clients_.erase(fd);
-    }
+WorkerPool* Server::workers() {
+    return &workers_;
 }
 
 }  // namespace tcpserver
@@ -4,34 +4,59 @@
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
 #ifndef TCPSERVER_TCPSERVER_SERVER_H_
 #define TCPSERVER_TCPSERVER_SERVER_H_
-#include <stdint.h>
-
-#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include "tcpserver/clientsocket.h"
 #include "tcpserver/commontypes.h"
-#include "tcpserver/epoll.h"
+#include "tcpserver/reactor.h"
 #include "tcpserver/serversocket.h"
+#include "tcpserver/serverstats.h"
+#include "tcpserver/workerpool.h"
 
 namespace tcpserver {
 
-typedef std::map<int, std::unique_ptr<ClientSocket>> csock_map;
-
 class Server {
  private:
-    ServerSocket socket_;
-    Epoll epoll_;
-    csock_map clients_;
+    std::string port_;
+    std::string unix_path_;
+    size_t reactor_count_;
+    WorkerPool workers_;
+    ServerStats stats_;
+    // listening sockets of all reactors, which outlive them
+    std::vector<std::unique_ptr<ServerSocket>> sockets_;
+    std::vector<std::unique_ptr<Reactor>> reactors_;
+    std::vector<std::thread> threads_;
+
+    // decodes all complete requests found at the start of `input` into jobs
+    // appended to `jobs`, and returns the number of bytes consumed. trailing
+    // bytes of an incomplete request are kept buffered and passed in again
+    // once more data arrives. `state` is kept for the connection between
+    // calls, it is empty on the first one. jobs are executed on the worker
+    // threads, one at a time per connection. with multiple reactors it is
+    // called from all of their threads concurrently
+    virtual size_t handle(const shared_byte_vec& input,
+                          connection_state* state,
+                          job_queue* jobs) = 0;
+    ServerSocket* open_socket(Transport transport,
+                              const std::string& address,
+                              bool reuse_port);
 
-    void accept_connection(int fd);
-    void receive_data(int fd);
-    virtual void handle(const byte_vec& input, byte_vec* output) = 0;
+ protected:
+    ServerStats* stats();
+    WorkerPool* workers();
 
  public:
-    explicit Server(const std::string& port);
+    // with zero workers all jobs are executed on the reactor threads. with
+    // more than one reactor each of them gets its own SO_REUSEPORT listening
+    // socket, and the kernel balances incoming connections between them.
+    // a unix domain socket is shared by all reactors instead. either the
+    // port or the unix socket path may be left empty, but not both
+    Server(const std::string& port,
+           const std::string& unix_path,
+           size_t workers = 0,
+           size_t reactors = 1);
     virtual ~Server();
     void start();
 };
@@ -4,7 +4,9 @@
 // file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
 #include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <cerrno>
@@ -16,15 +18,28 @@
 
 namespace tcpserver {
 
-ServerSocket::ServerSocket(const std::string& port): port_(port),
-                                                     socket_fd_(-1) {}
+ServerSocket::ServerSocket(Transport transport,
+                           const std::string& address,
+                           bool reuse_port): transport_(transport),
+                                             address_(address),
+                                             reuse_port_(reuse_port),
+                                             socket_fd_(-1),
+                                             owns_path_(false) {}
 
 ServerSocket::~ServerSocket() {
     if (socket_fd_ != -1)
         close(socket_fd_);
+    if (owns_path_)
+        unlink(address_.c_str());
 }
 
 int ServerSocket::bind() {
+    if (transport_ == UNIX_DOMAIN)
+        return bind_unix();
+    return bind_tcp();
+}
+
+int ServerSocket::bind_tcp() {
     struct addrinfo hints;
     struct addrinfo* addr_infos;
 
@@ -33,7 +48,7 @@ int ServerSocket::bind() {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    int ret_val = getaddrinfo(NULL, port_.c_str(), &hints, &addr_infos);
+    int ret_val = getaddrinfo(NULL, address_.c_str(), &hints, &addr_infos);
     if (ret_val != 0) {
         freeaddrinfo(addr_infos);
         std::string msg(gai_strerror(ret_val));
@@ -52,6 +67,16 @@ int ServerSocket::bind() {
                    SO_REUSEADDR,
                    &so_reuseaddr,
                    sizeof(so_reuseaddr));
+        int so_reuseport = 1;
+        if (reuse_port_ && setsockopt(socket_fd_,
+                                      SOL_SOCKET,
+                                      SO_REUSEPORT,
+                                      &so_reuseport,
+                                      sizeof(so_reuseport)) == -1) {
+            close(socket_fd_);
+            socket_fd_ = -1;
+            continue;
+        }
         if (::bind(socket_fd_, aip->ai_addr, aip->ai_addrlen) == 0)
             break; // bind succeeded
         // in case bind failed, close the created socket file descriptor
@@ -66,6 +91,58 @@ int ServerSocket::bind() {
     return socket_fd_;
 }
 
+bool stale(const struct sockaddr_un& addr, socklen_t addr_len) {
+    // a socket file nobody accepts on is left over from an earlier run
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe == -1)
+        return false;
+    bool refused = (connect(probe,
+                            reinterpret_cast<const struct sockaddr*>(&addr),
+                            addr_len) == -1 && errno == ECONNREFUSED);
+    close(probe);
+    return refused;
+}
+
+int ServerSocket::bind_unix() {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    bool abstract = (!address_.empty() && address_[0] == '@');
+    // abstract names are not null terminated, paths must be
+    size_t limit = abstract ? sizeof(addr.sun_path) : sizeof(addr.sun_path) - 1;
+    if (address_.empty() || address_.size() > limit ||
+            (abstract && address_.size() < 2))
+        throw socket_error("Invalid unix socket path.");
+    std::memcpy(addr.sun_path, address_.data(), address_.size());
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) +
+                         address_.size();
+    if (abstract)
+        addr.sun_path[0] = '\0';
+    else
+        addr_len += 1;
+
+    int flags = SOCK_STREAM | SOCK_CLOEXEC | O_NONBLOCK;
+    socket_fd_ = socket(AF_UNIX, flags, 0);
+    if (socket_fd_ == -1) {
+        std::string msg(std::strerror(errno));
+        throw socket_error(msg);
+    }
+    const struct sockaddr* p_addr = reinterpret_cast<struct sockaddr*>(&addr);
+    int ret = ::bind(socket_fd_, p_addr, addr_len);
+    if (ret == -1 && errno == EADDRINUSE && !abstract && stale(addr, addr_len)) {
+        unlink(address_.c_str());
+        ret = ::bind(socket_fd_, p_addr, addr_len);
+    }
+    if (ret == -1) {
+        std::string msg(std::strerror(errno));
+        close(socket_fd_);
+        socket_fd_ = -1;
+        throw socket_error(msg);
+    }
+    owns_path_ = !abstract;
+    return socket_fd_;
+}
+
 void ServerSocket::listen() {
     if (::listen(socket_fd_, SOMAXCONN) == -1) {
         std::string msg(std::strerror(errno));
@@ -77,4 +154,8 @@ int ServerSocket::fd() {
     return socket_fd_;
 }
 
+Transport ServerSocket::transport() {
+    return transport_;
+}
+
 }  // namespace tcpserver
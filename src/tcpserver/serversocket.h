@@ -8,17 +8,35 @@
 
 namespace tcpserver {
 
+enum Transport {
+    TCP = 1,
+    UNIX_DOMAIN = 2
+};
+
 class ServerSocket {
  private:
-    std::string port_;
+    Transport transport_;
+    // port number, or path of a unix domain socket, where a leading `@`
+    // stands for a name in the abstract namespace, which has no file
+    std::string address_;
+    // allow other sockets of this process to bind the same port
+    bool reuse_port_;
     int socket_fd_;
+    // whether a socket file was created that is removed again on close
+    bool owns_path_;
+
+    int bind_tcp();
+    int bind_unix();
 
  public:
-    explicit ServerSocket(const std::string& port);
+    ServerSocket(Transport transport,
+                 const std::string& address,
+                 bool reuse_port = false);
     ~ServerSocket();
     int bind();
     void listen();
     int fd();
+    Transport transport();
 };
 
 }  // namespace tcpserver
@@ -0,0 +1,41 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_SERVERSTATS_H_
+#define TCPSERVER_TCPSERVER_SERVERSTATS_H_
+#include <stdint.h>
+
+#include <atomic>
+
+namespace tcpserver {
+
+// counters shared by all reactors, updated with relaxed atomic operations
+// as they are only ever read for reporting
+struct ServerStats {
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> bytes_received;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> requests;
+    // decoded requests that did not start executing yet
+    std::atomic<uint64_t> pending_requests;
+
+    ServerStats(): connections(0),
+                   accepted(0),
+                   bytes_received(0),
+                   bytes_sent(0),
+                   requests(0),
+                   pending_requests(0) {}
+};
+
+inline void increment(std::atomic<uint64_t>* counter, uint64_t value = 1) {
+    counter->fetch_add(value, std::memory_order_relaxed);
+}
+
+inline void decrement(std::atomic<uint64_t>* counter, uint64_t value = 1) {
+    counter->fetch_sub(value, std::memory_order_relaxed);
+}
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_SERVERSTATS_H_
@@ -0,0 +1,260 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#include <stdint.h>
+
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "tcpserver/workerpool.h"
+
+namespace tcpserver {
+
+void WorkerPool::FlowHeap::place(size_t position, Flow* flow) {
+    flows_[position] = flow;
+    flow->*index_ = position;
+}
+
+void WorkerPool::FlowHeap::sift_up(size_t position) {
+    Flow* flow = flows_[position];
+    while (position > 0) {
+        size_t parent = (position - 1) / 2;
+        if (flows_[parent]->usage <= flow->usage)
+            break;
+        place(position, flows_[parent]);
+        position = parent;
+    }
+    place(position, flow);
+}
+
+void WorkerPool::FlowHeap::sift_down(size_t position) {
+    Flow* flow = flows_[position];
+    size_t size = flows_.size();
+    while (true) {
+        size_t child = position * 2 + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && flows_[child + 1]->usage < flows_[child]->usage)
+            child += 1;
+        if (flow->usage <= flows_[child]->usage)
+            break;
+        place(position, flows_[child]);
+        position = child;
+    }
+    place(position, flow);
+}
+
+bool WorkerPool::FlowHeap::empty() const {
+    return flows_.empty();
+}
+
+WorkerPool::Flow* WorkerPool::FlowHeap::top() const {
+    return flows_.front();
+}
+
+bool WorkerPool::FlowHeap::contains(const Flow* flow) const {
+    return flow->*index_ != FLOW_NOT_QUEUED;
+}
+
+void WorkerPool::FlowHeap::push(Flow* flow) {
+    flows_.push_back(flow);
+    sift_up(flows_.size() - 1);
+}
+
+void WorkerPool::FlowHeap::remove(Flow* flow) {
+    size_t position = flow->*index_;
+    flow->*index_ = FLOW_NOT_QUEUED;
+    Flow* last = flows_.back();
+    flows_.pop_back();
+    if (last == flow)
+        return;
+    // the last one takes its place, and moves up or down from there
+    place(position, last);
+    sift_up(position);
+    sift_down(last->*index_);
+}
+
+WorkerPool::WorkerPool(size_t size): size_(size),
+                                     next_flow_(DEFAULT_FLOW + 1),
+                                     readable_(&Flow::read_index),
+                                     writable_(&Flow::write_index),
+                                     queued_(0),
+                                     clock_(0),
+                                     stopping_(false) {}
+
+WorkerPool::~WorkerPool() {
+    stop();
+}
+
+void WorkerPool::start() {
+    for (size_t i = 0; i < size_; ++i)
+        threads_.push_back(std::thread(&WorkerPool::run, this));
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+    threads_.clear();
+}
+
+WorkerPool::Flow* WorkerPool::find_flow(flow_id id) {
+    auto found = flows_.find(id);
+    if (found == flows_.end()) {
+        found = flows_.insert(std::make_pair(id, Flow())).first;
+        found->second.id = id;
+        // jobs submitted to a flow after it was removed and erased get one
+        // with the default configuration for as long as they wait
+        found->second.removed = id != DEFAULT_FLOW;
+    }
+    return &found->second;
+}
+
+void WorkerPool::requeue(Flow* flow) {
+    if (readable_.contains(flow))
+        readable_.remove(flow);
+    if (writable_.contains(flow))
+        writable_.remove(flow);
+    if (!flow->reads.empty())
+        readable_.push(flow);
+    if (!flow->writes.empty() && flow->running_writes < flow->max_writes)
+        writable_.push(flow);
+}
+
+void WorkerPool::erase_if_done(Flow* flow) {
+    // not in any heap either without jobs waiting
+    if (flow->removed &&
+            flow->running == 0 &&
+            flow->reads.empty() &&
+            flow->writes.empty())
+        flows_.erase(flow->id);
+}
+
+flow_id WorkerPool::add_flow(uint32_t weight, size_t max_writes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flow_id id = next_flow_++;
+    Flow* added = find_flow(id);
+    added->weight = weight > 0 ? weight : 1;
+    added->max_writes = max_writes > 0 ? max_writes : 1;
+    added->removed = false;
+    return id;
+}
+
+void WorkerPool::remove_flow(flow_id flow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = flows_.find(flow);
+    if (found == flows_.end())
+        return;
+    found->second.removed = true;
+    erase_if_done(&found->second);
+}
+
+void WorkerPool::submit(work_fn fn) {
+    submit(std::move(fn), DEFAULT_FLOW, false);
+}
+
+void WorkerPool::submit(work_fn fn, flow_id flow, bool write) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Flow* queue = find_flow(flow);
+        // a flow that was idle starts out even with the busy ones, instead
+        // of making up for the time it did not use
+        if (queue->reads.empty() &&
+                queue->writes.empty() &&
+                queue->usage < clock_)
+            queue->usage = clock_;
+        if (write)
+            queue->writes.push_back(std::move(fn));
+        else
+            queue->reads.push_back(std::move(fn));
+        requeue(queue);
+        queued_ += 1;
+    }
+    cond_.notify_one();
+}
+
+size_t WorkerPool::size() {
+    return size_;
+}
+
+size_t WorkerPool::queued() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_;
+}
+
+bool WorkerPool::next(work_fn* fn, Flow** flow, bool* write) {
+    // the flows that used the least time so far, among those with a read,
+    // and those with a write allowed to run
+    Flow* reader = readable_.empty() ? NULL : readable_.top();
+    Flow* writer = writable_.empty() ? NULL : writable_.top();
+    if (reader == NULL && writer == NULL)
+        return false;
+    // whichever used less goes next. a flow with reads is among the
+    // readable ones as well, so the writer only wins if it has none
+    Flow* picked = writer;
+    if (reader != NULL && (writer == NULL || reader->usage <= writer->usage))
+        picked = reader;
+    bool may_write = writable_.contains(picked);
+    *flow = picked;
+    *write = may_write && (picked->reads.empty() ||
+                           picked->reads_ahead >= MAX_READS_AHEAD);
+    if (*write) {
+        *fn = std::move(picked->writes.front());
+        picked->writes.pop_front();
+        picked->running_writes += 1;
+        picked->reads_ahead = 0;
+    } else {
+        *fn = std::move(picked->reads.front());
+        picked->reads.pop_front();
+        if (may_write)
+            picked->reads_ahead += 1;
+    }
+    queued_ -= 1;
+    clock_ = (*flow)->usage;
+    (*flow)->usage += MIN_JOB_COST_NS / (*flow)->weight;
+    (*flow)->running += 1;
+    requeue(*flow);
+    return true;
+}
+
+void WorkerPool::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        work_fn fn;
+        Flow* flow;
+        bool write;
+        while (!next(&fn, &flow, &write)) {
+            if (stopping_ && queued_ == 0)
+                return;  // stopping and nothing left to do
+            cond_.wait(lock);
+        }
+        lock.unlock();
+        std::chrono::steady_clock::time_point start(
+                                        std::chrono::steady_clock::now());
+        fn();
+        fn = nullptr;
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        lock.lock();
+        // the rest of the time the job took, beyond what it was charged
+        if (elapsed > MIN_JOB_COST_NS)
+            flow->usage += (elapsed - MIN_JOB_COST_NS) / flow->weight;
+        flow->running -= 1;
+        if (write) {
+            flow->running_writes -= 1;
+            if (!flow->writes.empty())
+                cond_.notify_one();
+        }
+        requeue(flow);
+        erase_if_done(flow);
+    }
+}
+
+}  // namespace tcpserver
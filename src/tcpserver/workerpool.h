@@ -0,0 +1,138 @@
+// Copyright 2015, Outernet Inc.
+// Some rights reserved.
+// This software is free software licensed under the terms of GPLv3. See COPYING
+// file that comes with the source code, or http://www.gnu.org/licenses/gpl.txt.
+#ifndef TCPSERVER_TCPSERVER_WORKERPOOL_H_
+#define TCPSERVER_TCPSERVER_WORKERPOOL_H_
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "tcpserver/commontypes.h"
+#include "tcpserver/fifo.h"
+
+namespace tcpserver {
+
+typedef std::function<void()> work_fn;
+
+// position of a flow that is not in a heap
+static const size_t FLOW_NOT_QUEUED = SIZE_MAX;
+// reads of a flow taken in a row while one of its writes may run, after
+// which the write goes first, so that a steady stream of reads cannot
+// starve them
+static const size_t MAX_READS_AHEAD = 8;
+// charged to a flow when one of its jobs starts, so that a flow is not
+// picked over and over before its first jobs finish and are accounted for
+static const uint64_t MIN_JOB_COST_NS = 10000;
+
+// Thread pool running submitted functions in an order of its own. Jobs are
+// queued by flow, e.g. the database they work on, and within a flow reads
+// and writes are queued apart, each in submission order. Flows take turns
+// by the worker time they used so far, weighted, so that a flow busy with
+// long jobs does not hold up the others, and within a flow reads are taken
+// before writes. Writes of a flow may be limited to run one or a few
+// at a time, leaving the rest of the workers to other flows while its
+// writes wait for each other anyway. Only flows with jobs that may run are
+// looked at when picking the next one, idle flows cost nothing.
+class WorkerPool {
+ private:
+    struct Flow {
+        flow_id id;
+        Fifo<work_fn> reads;
+        Fifo<work_fn> writes;
+        uint32_t weight;
+        size_t max_writes;
+        size_t running_writes;
+        size_t running;
+        size_t reads_ahead;
+        // worker time used so far divided by the weight, in nanoseconds
+        uint64_t usage;
+        // positions in the heaps of flows with reads, and of flows with
+        // writes allowed to run
+        size_t read_index;
+        size_t write_index;
+        // erased once its last job finished
+        bool removed;
+
+        Flow(): id(DEFAULT_FLOW),
+                weight(1),
+                max_writes(SIZE_MAX),
+                running_writes(0),
+                running(0),
+                reads_ahead(0),
+                usage(0),
+                read_index(FLOW_NOT_QUEUED),
+                write_index(FLOW_NOT_QUEUED),
+                removed(false) {}
+    };
+
+    // Binary min-heap of flows by usage, which keeps the position of each
+    // flow in the member of Flow it is given, so that a flow is removed or
+    // moved without searching for it. Its storage is kept once grown.
+    class FlowHeap {
+     private:
+        std::vector<Flow*> flows_;
+        size_t Flow::*index_;
+
+        void place(size_t position, Flow* flow);
+        void sift_up(size_t position);
+        void sift_down(size_t position);
+
+     public:
+        explicit FlowHeap(size_t Flow::*index): index_(index) {}
+        bool empty() const;
+        Flow* top() const;
+        bool contains(const Flow* flow) const;
+        void push(Flow* flow);
+        void remove(Flow* flow);
+    };
+
+    size_t size_;
+    std::vector<std::thread> threads_;
+    // flows stay where they are until removed, so their addresses are
+    // valid for as long as they have jobs
+    std::unordered_map<flow_id, Flow> flows_;
+    flow_id next_flow_;
+    FlowHeap readable_;
+    FlowHeap writable_;
+    size_t queued_;
+    // usage of the flow picked last, which flows becoming busy start from
+    uint64_t clock_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stopping_;
+
+    Flow* find_flow(flow_id id);
+    // puts the flow into the heaps it belongs to now, at the position its
+    // usage gives it, to be called after any change to it
+    void requeue(Flow* flow);
+    // erases a removed flow once it has no jobs left
+    void erase_if_done(Flow* flow);
+    // takes the next job to run, false if none may run now
+    bool next(work_fn* fn, Flow** flow, bool* write);
+    void run();
+
+ public:
+    explicit WorkerPool(size_t size);
+    ~WorkerPool();
+    void start();
+    void stop();
+    // returns a new flow for submitting to, which is identified by a number
+    // instead of its name so that submitting does not copy or compare names
+    flow_id add_flow(uint32_t weight, size_t max_writes);
+    // forgets the flow once the jobs already submitted to it are done
+    void remove_flow(flow_id flow);
+    void submit(work_fn fn);
+    void submit(work_fn fn, flow_id flow, bool write);
+    size_t size();
+    // number of submitted functions waiting for a free thread
+    size_t queued();
+};
+
+}  // namespace tcpserver
+#endif  // TCPSERVER_TCPSERVER_WORKERPOOL_H_